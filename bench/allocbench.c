@@ -0,0 +1,363 @@
+/*
+    * allocbench.c
+    * 
+    * ABSTRACT:
+    * 
+    *   -> Host-side microbenchmarks for the frame allocator and the kernel heap.
+    *   -> The allocator sources are built for Linux (see `make bench`) and fed a fake Limine memory
+    *   -> map backed by mmap'd buffers, so allocator changes can be measured without booting QEMU.
+    * 
+    * COPYRIGHT (C) 2023 DanielH
+    * This code along with the rest of this project is licensed under the MIT open-source license. A copy of the MIT license should be included in the source tree.
+    *
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <asm/prctl.h>
+#include "../src/limine.h"
+#include "../src/mm/allocator/allocator.h"
+#include "../src/mm/allocator/zeropool.h"
+#include "../src/mm/heapalloc/heap.h"
+#include "../src/mm/slab/slab.h"
+#include "../src/system/percpu.h"
+
+#define MiB (1024 * 1024ULL)
+
+#define LOW_SIZE (96 * MiB)   // Carved into usable, reserved and reclaimable entries below 4GiB
+#define HIGH_BASE 0x200000000 // NORMAL zone memory, placed at a fixed address above 4GiB
+#define HIGH_SIZE (128 * MiB)
+
+#define HEAP_SLOTS 1024
+#define HEAP_PHASES 10
+
+struct PerCPU benchCPU[2] = { { .id = 0 }, { .id = 1 } };
+
+struct limine_memmap_entry entries[8];
+struct limine_memmap_entry* entryPtrs[8];
+
+uint64_t scale = 1;
+uint64_t rngState = 0x2545F4914F6CDD1D;
+
+/* Kernel services the allocator sources expect. */
+void panic(const char* customStr)
+{
+    printf("KERNEL PANIC: %s\n", customStr);
+    _exit(1);
+}
+
+void KernelSoftError(const char* error)
+{
+    printf("Soft error: %s\n", error);
+}
+
+void serial_printf(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+/* There are no page tables to map into, so large allocations take the heap's contiguous fallback. */
+void* KernelVmAlloc(size_t)
+{
+    return NULL;
+}
+
+void KernelVmFree(void*)
+{
+}
+
+uint64_t KernelVmSize(void*)
+{
+    return 0;
+}
+
+/* Pretends to migrate to another CPU by pointing GS at its PerCPU block. */
+static bool SwitchCPU(int cpu)
+{
+    return syscall(SYS_arch_prctl, ARCH_SET_GS, &benchCPU[cpu]) == 0;
+}
+
+static uint64_t Random()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+static uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void Report(const char* name, uint64_t ops, uint64_t ns)
+{
+    printf("%-44s %10llu ops %9.1f ns/op\n", name, (unsigned long long)ops, (double)ns / ops);
+}
+
+static void AddEntry(size_t* count, uint64_t base, uint64_t length, uint64_t type)
+{
+    entries[*count] = (struct limine_memmap_entry){ .base = base, .length = length, .type = type };
+    entryPtrs[*count] = &entries[*count];
+    (*count)++;
+}
+
+/*
+    SUBROUTINE:
+
+    * SetupFakeMachine()
+    * Builds a memory map resembling a fragmented firmware map and boots the frame allocator on it.
+    * Addresses are host virtual addresses, which the allocator treats as identity mapped frames.
+*/
+static bool SetupFakeMachine()
+{
+    size_t count = 0;
+
+    /* The DMA32 zone needs memory below 4GiB. */
+    uint8_t* low = mmap(NULL, LOW_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (low == MAP_FAILED)
+    {
+        printf("mmap of low memory failed\n");
+        return false;
+    }
+
+    AddEntry(&count, (uint64_t)low, 48 * MiB, LIMINE_MEMMAP_USABLE);
+    AddEntry(&count, (uint64_t)low + 48 * MiB, 4 * MiB, LIMINE_MEMMAP_RESERVED);
+    AddEntry(&count, (uint64_t)low + 52 * MiB, 36 * MiB, LIMINE_MEMMAP_USABLE);
+    AddEntry(&count, (uint64_t)low + 88 * MiB, 8 * MiB, LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE);
+
+    uint8_t* high = mmap((void*)HIGH_BASE, HIGH_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (high == (void*)HIGH_BASE) AddEntry(&count, HIGH_BASE, HIGH_SIZE, LIMINE_MEMMAP_USABLE);
+    else printf("Could not place memory above 4GiB, NORMAL zone left empty\n");
+
+    struct limine_memmap_response mmap =
+    {
+        .revision = 0,
+        .entry_count = count,
+        .entries = entryPtrs,
+    };
+
+    InitializeAllocator(mmap);
+    OnlineNormalZone();
+    ReclaimBootloaderMemory();
+
+    return true;
+}
+
+static void PrintZones(const char* when)
+{
+    printf("Zones %s:\n", when);
+
+    for (enum ZoneType zone = 0; zone < ZONE_COUNT; zone++)
+    {
+        struct ZoneStats stats;
+        GetZoneStats(zone, &stats);
+
+        printf("    %-6s %8llu KiB total %8llu KiB free, largest free block %llu KiB\n",
+               stats.name,
+               (unsigned long long)stats.totalFrames * 4,
+               (unsigned long long)stats.freeFrames * 4,
+               (unsigned long long)stats.largestFreeBlock * 4);
+    }
+}
+
+static void BenchFrames()
+{
+    static void* frames[4096];
+    uint64_t ops = 1000000 * scale;
+    uint64_t start;
+
+    start = NowNs();
+    for (uint64_t i = 0; i < ops; i++) PageFree(PageAllocNoZero());
+    Report("PageAllocNoZero + PageFree", ops, NowNs() - start);
+
+    start = NowNs();
+    for (uint64_t i = 0; i < ops / 10; i++) PageFree(PageAlloc());
+    Report("PageAlloc (zeroed) + PageFree", ops / 10, NowNs() - start);
+
+    uint64_t rounds = 200 * scale;
+    start = NowNs();
+    for (uint64_t r = 0; r < rounds; r++)
+    {
+        for (size_t i = 0; i < 4096; i++) frames[i] = PageAllocNoZero();
+        for (size_t i = 0; i < 4096; i++) PageFree(frames[4095 - i]);
+    }
+    Report("Burst of 4096 frames, alloc then free", rounds * 4096, NowNs() - start);
+
+    uint8_t orders[] = { 0, 3, 9 };
+    for (size_t o = 0; o < sizeof(orders); o++)
+    {
+        char name[64];
+        uint64_t n = ops / (1 + orders[o]);
+
+        snprintf(name, sizeof(name), "PageAllocOrder(%d) + PageFreeOrder", orders[o]);
+
+        start = NowNs();
+        for (uint64_t i = 0; i < n; i++) PageFreeOrder(PageAllocOrder(orders[o]), orders[o]);
+        Report(name, n, NowNs() - start);
+    }
+
+    start = NowNs();
+    ZeroPoolRefill();
+    Report("ZeroPoolRefill, per frame", ZeroPoolSize(), NowNs() - start);
+}
+
+static void BenchSlab()
+{
+    static void* objects[4096];
+    struct SlabCache* cache = SlabCacheCreate("bench-64", 64);
+    uint64_t ops = 1000000 * scale;
+    uint64_t start;
+
+    if (!cache)
+    {
+        printf("SlabCacheCreate failed\n");
+        return;
+    }
+
+    start = NowNs();
+    for (uint64_t i = 0; i < ops; i++) SlabFree(SlabAlloc(cache));
+    Report("SlabAlloc(64) + SlabFree", ops, NowNs() - start);
+
+    uint64_t rounds = 200 * scale;
+    start = NowNs();
+    for (uint64_t r = 0; r < rounds; r++)
+    {
+        for (size_t i = 0; i < 4096; i++) objects[i] = SlabAlloc(cache);
+        for (size_t i = 0; i < 4096; i++) SlabFree(objects[i]);
+    }
+    Report("Burst of 4096 slab objects, alloc then free", rounds * 4096, NowNs() - start);
+}
+
+/* Roughly log-uniform size from 16 bytes up to (not including) 16KiB, most requests are small. */
+static uint64_t RandomSize()
+{
+    uint64_t shift = 4 + Random() % 10;
+    return (1ULL << shift) + Random() % (1ULL << shift);
+}
+
+static void BenchHeap()
+{
+    static void* slots[HEAP_SLOTS];
+    uint64_t ops = 1000000 * scale;
+    uint64_t start;
+
+    start = NowNs();
+    for (uint64_t i = 0; i < ops; i++) free(malloc(64));
+    Report("malloc(64) + free", ops, NowNs() - start);
+
+    /* A growing table next to other live allocations, like a ramdisk index being built. */
+    uint64_t rounds = 100 * scale;
+    uint64_t moves = 0;
+    start = NowNs();
+    for (uint64_t r = 0; r < rounds; r++)
+    {
+        void* table = NULL;
+        void* neighbour = malloc(64);
+
+        for (size_t len = 64; len <= 64 * 1024; len += 64)
+        {
+            void* grown = realloc(table, len);
+
+            if (grown != table) moves++;
+            table = grown;
+        }
+
+        free(neighbour);
+        free(table);
+    }
+    Report("realloc growing 64B to 64KiB in 64B steps", rounds * 1024, NowNs() - start);
+    printf("    %llu of %llu calls moved the block\n", (unsigned long long)moves, (unsigned long long)rounds * 1024);
+
+    /* Producer/consumer: CPU 0 allocates, CPU 1 frees onto CPU 0's remote-free list. */
+    static void* batch[HEAP_SLOTS];
+    rounds = 1000 * scale;
+    start = NowNs();
+    for (uint64_t r = 0; r < rounds; r++)
+    {
+        for (size_t i = 0; i < HEAP_SLOTS; i++) batch[i] = malloc(128);
+
+        SwitchCPU(1);
+        for (size_t i = 0; i < HEAP_SLOTS; i++) free(batch[i]);
+        SwitchCPU(0);
+    }
+    Report("malloc(128) on CPU 0, free on CPU 1", rounds * HEAP_SLOTS, NowNs() - start);
+
+    printf("Random-size churn, %d live slots, sizes 16B-16KiB:\n", HEAP_SLOTS);
+    printf("    %-6s %10s %12s %12s %10s %6s\n", "phase", "ns/op", "heap KiB", "in use KiB", "free nodes", "util");
+
+    uint64_t phaseOps = 5000 * scale;
+    for (int phase = 0; phase < HEAP_PHASES; phase++)
+    {
+        start = NowNs();
+
+        for (uint64_t i = 0; i < phaseOps; i++)
+        {
+            size_t slot = Random() % HEAP_SLOTS;
+
+            if (slots[slot]) free(slots[slot]);
+            slots[slot] = malloc(RandomSize());
+        }
+
+        uint64_t ns = NowNs() - start;
+        struct HeapStats stats;
+        GetHeapStats(&stats);
+
+        printf("    %-6d %10.1f %12llu %12llu %10llu %5.1f%%\n",
+               phase,
+               (double)ns / phaseOps,
+               (unsigned long long)stats.heapBytes / 1024,
+               (unsigned long long)stats.bytesInUse / 1024,
+               (unsigned long long)stats.freeNodes,
+               stats.heapBytes ? 100.0 * stats.bytesInUse / stats.heapBytes : 0.0);
+    }
+
+    for (size_t i = 0; i < HEAP_SLOTS; i++)
+    {
+        if (slots[i]) free(slots[i]);
+        slots[i] = NULL;
+    }
+
+    struct HeapStats stats;
+    GetHeapStats(&stats);
+    printf("    after freeing everything: %llu KiB still held by the heap\n",
+           (unsigned long long)stats.heapBytes / 1024);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+    {
+        scale = 0;
+        for (char* c = argv[1]; *c >= '0' && *c <= '9'; c++) scale = scale * 10 + (*c - '0');
+        if (!scale) scale = 1;
+    }
+
+    /* GetCPUId() reads the per-CPU block through GS, just like in the kernel. */
+    if (!SwitchCPU(0))
+    {
+        printf("arch_prctl(ARCH_SET_GS) failed\n");
+        return 1;
+    }
+
+    if (!SetupFakeMachine()) return 1;
+
+    PrintZones("after boot");
+    BenchFrames();
+    BenchSlab();
+    BenchHeap();
+    PrintZones("at exit");
+
+    return 0;
+}
@@ -33,6 +33,8 @@
 #include "bootloader.h"
 #include "../gdt/gdt.h"
 #include "../mm/allocator/allocator.h"
+#include "../mm/allocator/zeropool.h"
+#include "../mm/stats/memstats.h"
 #include "../interrupts/idt.h"
 #include "../mm/paging/paging.h"
 #include "../drivers/pit.h"
@@ -42,6 +44,7 @@
 #include "../util/print.h"
 #include "../ramdisk/tar.h"
 #include "../elf/elf.h"
+#include "../system/percpu.h"
 
 extern uint8_t kernelStart[];
 extern uint8_t kernelEnd[];
@@ -49,6 +52,7 @@ extern uint8_t kernelEnd[];
 void _kmain()
 {
     InitializeGDT();
+    InitializePerCPU(0); // Bootstrap processor
 
     struct Bootloader bootloader = InitializeBootloader();
 
@@ -60,7 +64,7 @@ void _kmain()
     InitializeACPI(bootloader.rsdp);
 
     uintptr_t framebuffer_base = (uintptr_t)bootloader.fb.framebuffers[0]->address;
-    uintptr_t framebuffer_size = (bootloader.fb.framebuffers[0]->width * bootloader.fb.framebuffers[0]->height * bootloader.fb.framebuffers[0]->bpp) + 0x1000;
+    uintptr_t framebuffer_size = bootloader.fb.framebuffers[0]->pitch * bootloader.fb.framebuffers[0]->height;
 
     InitializeAllocator(bootloader.mmap);
 
@@ -78,6 +82,9 @@ void _kmain()
 
     if (bootloader.mod) InitializeRamdisk((uintptr_t)bootloader.mod->modules[0]->address);
 
+    // Every Limine response has been consumed by now, hand its memory to the frame allocator.
+    ReclaimBootloaderMemory();
+
     //MarkSchedulingActive();
 
     char* elfTargetFileName = "a.out";
@@ -159,10 +166,18 @@ void _kmain()
         {
             printf("Unable to allocate space to copy ELF to, refusing to load!\n");
         }
+
+        // Nothing refers to the file image past this point.
+        free(buffer);
     }
 
     while(1)
     {
+        // Idle: clear frames ahead of time for PageAlloc()
+        ZeroPoolRefill();
+        HeapTrim();
+        MemoryStatsPeriodicDump();
+        MemoryStatsPollSerial();
         asm ("hlt");
     }
 }
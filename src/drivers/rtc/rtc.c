@@ -17,6 +17,8 @@
 #include "rtc.h"
 #include "../../util/ioports.h"
 
+uint64_t rtcTicks = 0;
+
 void InitializeRTC()
 {
     asm ("cli");
@@ -40,4 +42,12 @@ void RTC_Check()
 {
     outb(0x70, 0x0C);
     inb(0x71);
+
+    rtcTicks++;
+}
+
+/* Periodic interrupts since InitializeRTC(), RTC_TICKS_PER_SECOND per second. */
+uint64_t RTC_GetTicks()
+{
+    return rtcTicks;
 }
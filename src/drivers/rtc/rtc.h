@@ -15,6 +15,10 @@
 */
 
 #pragma once
+#include <stdint.h>
+
+#define RTC_TICKS_PER_SECOND 2 // Rate 15 in InitializeRTC()
 
 void InitializeRTC();
 void RTC_Check();
+uint64_t RTC_GetTicks();
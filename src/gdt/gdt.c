@@ -48,8 +48,26 @@ struct GlobalDescriptorTable globalDescriptorTable =
         .access = 0xF2,
         .granularity = 0xC0,
     },
+    // TSS, 0x28. The base is only known at runtime, see InitializeGDT()
+    {
+        .low =
+        {
+            .limit = sizeof(struct TaskStateSegment) - 1,
+            .access = 0x89, // Present, available 64-bit TSS
+            .granularity = 0,
+        },
+    },
+};
+
+/* Only the boot CPU is brought up, so there is one TSS and one set of interrupt stacks. */
+struct TaskStateSegment taskStateSegment =
+{
+    .iopbOffset = sizeof(struct TaskStateSegment), // No I/O permission bitmap
 };
 
+uint8_t pageFaultStack[IST_STACK_SIZE] __attribute__((aligned(16)));
+uint8_t timerStack[IST_STACK_SIZE] __attribute__((aligned(16)));
+
 struct GlobalDescriptorTablePtr gdtPtr =
 {
     .size = sizeof(struct GlobalDescriptorTable) - 1,
@@ -58,5 +76,18 @@ struct GlobalDescriptorTablePtr gdtPtr =
 
 void InitializeGDT()
 {
+    uint64_t tss = (uint64_t)&taskStateSegment;
+
+    globalDescriptorTable.tss.low.base_low = tss & 0xFFFF;
+    globalDescriptorTable.tss.low.base_middle = (tss >> 16) & 0xFF;
+    globalDescriptorTable.tss.low.base_high = (tss >> 24) & 0xFF;
+    globalDescriptorTable.tss.base_upper = tss >> 32;
+
+    // Stacks grow down, so each slot points at the end of its stack.
+    taskStateSegment.ist[IST_PAGE_FAULT - 1] = (uint64_t)pageFaultStack + IST_STACK_SIZE;
+    taskStateSegment.ist[IST_TIMER - 1] = (uint64_t)timerStack + IST_STACK_SIZE;
+
     loadgdt(&gdtPtr);
+
+    asm volatile ( "ltr %0" : : "r"((uint16_t)TSS_SELECTOR) );
 }
\ No newline at end of file
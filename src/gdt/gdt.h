@@ -1,6 +1,13 @@
 #pragma once
 #include <stdint.h>
 
+#define TSS_SELECTOR 0x28
+
+/* Interrupt stack table slots, see InitializeGDT() */
+#define IST_PAGE_FAULT 1 // Task stacks are demand paged, so a fault must not be pushed onto one
+#define IST_TIMER      2 // The task switch loads another CR3 before it pops the interrupt frame
+#define IST_STACK_SIZE 0x4000
+
 struct SegmentDescriptor
 {
     uint16_t limit;
@@ -11,6 +18,25 @@ struct SegmentDescriptor
     uint8_t base_high;
 }__attribute__((packed));
 
+/* 64-bit system segments (the TSS) take two slots, the upper one holds bits 32-63 of the base. */
+struct SystemSegmentDescriptor
+{
+    struct SegmentDescriptor low;
+    uint32_t base_upper;
+    uint32_t reserved;
+}__attribute__((packed));
+
+struct TaskStateSegment
+{
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7]; // ist[0] is IST slot 1
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iopbOffset;
+}__attribute__((packed));
+
 struct GlobalDescriptorTable
 {
     struct SegmentDescriptor null;
@@ -18,7 +44,7 @@ struct GlobalDescriptorTable
     struct SegmentDescriptor kernelData;
     struct SegmentDescriptor userCode;
     struct SegmentDescriptor userData;
-    /* struct SegmentDescriptor tss */
+    struct SystemSegmentDescriptor tss;
 }__attribute__((packed));
 
 struct GlobalDescriptorTablePtr {
@@ -27,6 +27,9 @@
 #include "../drivers/apic/apic.h"
 #include "../drivers/rtc/rtc.h"
 #include "../mm/paging/paging.h"
+#include "../mm/vmm/vmm.h"
+#include "../util/cr.h"
+#include "../gdt/gdt.h"
 
 struct InterruptDescriptor idt[256] = {0}; // 256 IDT entries
 struct InterruptDescriptorTablePtr idtr;
@@ -124,15 +127,19 @@ __attribute__((interrupt)) void InvalidTSSHandler(void*)
     CommonExceptionHandler("Invalid TSS");
 }
 
-__attribute__((interrupt)) void PageFaultHandler(void*)
+__attribute__((interrupt)) void PageFaultHandler(void*, uint64_t error)
 {
+    uint64_t addr = read_cr2();
+
+    // Demand paged process memory is mapped on first touch.
+    if (HandlePageFault(addr, error) == KSTATUS_SUCCESS) return;
+
+    printf("Page fault at 0x%x, error code 0x%x\n", addr, error);
     CommonExceptionHandler("Page fault");
 }
 
 __attribute__((interrupt)) void KeyboardHandler(void* )
 {
-    LoadKernelPML4();
-
     int sc = inb(0x60);
 
     KeyboardDriver(sc);
@@ -167,6 +174,9 @@ void InitializeIDT()
     AddIDTEntry(idt, &BreakpointHandler, INTERRUPT_BREAKPOINT, IDT_GATE_INTERRUPT);
     AddIDTEntry(idt, &SyscallStub, 0x80, IDT_GATE_INTERRUPT);
     AddIDTEntry(idt, &TimerStub, IRQ(IRQ_RTC), IDT_GATE_INTERRUPT);
+
+    idt[INTERRUPT_PAGE_FAULT].ist = IST_PAGE_FAULT;
+    idt[IRQ(IRQ_RTC)].ist = IST_TIMER;
     
     asm ("lidt %0" : : "m" (idtr));
 
@@ -3,7 +3,6 @@ section .text
 extern TaskSwitch
 extern LAPIC_EOI
 extern SyscallHandler
-extern LoadKernelPML4
 extern _TaskSwitch_Stage2
 global TimerStub
 global SyscallStub
@@ -12,9 +11,12 @@ global DisablePIC
 ; pushes them to the stack, and then provides a pointer to the stack
 ; as the first parameter to the interrupt handler.
 
+; Every address space maps the whole kernel, so the stubs run on whatever CR3 was loaded.
+; TimerStub runs on its own IST stack (see gdt.h): task stacks are private to their address space,
+; and it pops the interrupt frame after _TaskSwitch_Stage2 has loaded the next task's CR3.
+
 TimerStub:
     ;CLD
-    CALL LoadKernelPML4
 
     ; Once the exception handler is called, certain values are pushed to the stack
     ; such as the CS, IP, SS etc
@@ -62,8 +64,6 @@ TimerStub:
     IRETQ
 
 SyscallStub:
-    CALL LoadKernelPML4
-
     PUSH rax
     PUSH rbx
     PUSH rcx
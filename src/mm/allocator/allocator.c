@@ -4,6 +4,15 @@
     * ABSTRACT:
     * 
     *   -> Implements a simple page frame allocation. In this case the size is 4096 (0x1000).
+    *   -> Frames are handed out by a buddy allocator (see buddy.c), so runs of 2^n physically
+    *   -> contiguous frames are available as well as single frames.
+    *   -> Every usable memory map entry is managed, split into two zones: DMA32 (below 4GiB, for
+    *   -> devices limited to 32-bit addresses) and NORMAL (everything above).
+    *   -> Single frames go through a small per-CPU stack (magazine) that is refilled from and drained
+    *   -> to the zones in batches, so the common PageAlloc()/PageFree() pair never takes a zone lock.
+    *   -> PageAlloc() prefers frames cleared ahead of time by the zero pool (see zeropool.c).
+    *   -> Each zone keeps a struct Page entry per frame (see page.h) with a reference count, so frames
+    *   -> can be shared and PageFree() can reject frames that are not allocated.
     * 
     * COPYRIGHT (C) 2023 DanielH
     * This code along with the rest of this project is licensed under the MIT open-source license. A copy of the MIT license should be included in the source tree.
@@ -17,81 +26,588 @@
 
 #include "allocator.h"
 #include <stddef.h>
+#include "buddy.h"
+#include "zeropool.h"
 #include "../../util/memutil.h"
 #include "../../system/panic.h"
+#include "../../system/error.h"
+#include "../../system/percpu.h"
+#include "../../util/print.h"
+#include "../../multitasking/spinlock.h"
 
-struct Page
+#define FRAME_SIZE 0x1000
+#define DMA32_LIMIT 0x100000000
+#define MAX_RECLAIM_RANGES 64
+#define MAGAZINE_SIZE 64
+#define MAGAZINE_BATCH 32 // Frames moved per refill or drain
+
+struct Zone
 {
-    void* ptr;
-    bool free : 1;
+    const char* name;
+    uint64_t start; // Lowest managed address
+    uint64_t end;   // One past the highest managed address
+    bool online;
+    _Atomic uint8_t lock;
+    uint64_t metadataStart; // Frames holding this zone's struct Page array, never handed out
+    uint64_t metadataEnd;
+    struct BuddyAllocator buddy;
 };
 
-struct Page* FrameList = {0};
-uint64_t LargestMemSegSize = 0;
+/* Per-CPU stack of free frames, only touched by its own CPU with interrupts disabled. */
+struct FrameMagazine
+{
+    uint64_t count;
+    void* frames[MAGAZINE_SIZE];
+}__attribute__((aligned(64)));
+
+struct FrameMagazine Magazines[MAX_CPUS] = {0};
 
-void InitializeAllocator(struct limine_memmap_response mmap)
+struct Zone Zones[ZONE_COUNT] =
+{
+    [ZONE_DMA32] = { .name = "DMA32" },
+    [ZONE_NORMAL] = { .name = "NORMAL" },
+};
+
+/* The memory map is kept so the NORMAL zone and reclaimable memory can be added later. */
+struct limine_memmap_response BootMemoryMap = {0};
+
+/*
+    SUBROUTINE:
+
+    * ClipToZone()
+    * Clips [start, end) to the address range of a zone. Returns false if nothing is left.
+*/
+static bool ClipToZone(enum ZoneType zone, uint64_t* start, uint64_t* end)
+{
+    uint64_t zoneStart = (zone == ZONE_DMA32) ? 0 : DMA32_LIMIT;
+    uint64_t zoneEnd = (zone == ZONE_DMA32) ? DMA32_LIMIT : UINT64_MAX;
+
+    if (*start < zoneStart) *start = zoneStart;
+    if (*end > zoneEnd) *end = zoneEnd;
+
+    return *start < *end;
+}
+
+/*
+    SUBROUTINE:
+
+    * AddRangeToZone()
+    * Gives [start, end) to a zone, skipping the frames that hold its struct Page array.
+*/
+static void AddRangeToZone(enum ZoneType zone, uint64_t start, uint64_t end)
+{
+    uint64_t metadataStart = Zones[zone].metadataStart;
+    uint64_t metadataEnd = Zones[zone].metadataEnd;
+
+    if (!ClipToZone(zone, &start, &end)) return;
+
+    if (start < metadataEnd && metadataStart < end)
+    {
+        if (start < metadataStart) BuddyAddRange(&Zones[zone].buddy, start, metadataStart);
+        if (metadataEnd < end) BuddyAddRange(&Zones[zone].buddy, metadataEnd, end);
+        return;
+    }
+
+    BuddyAddRange(&Zones[zone].buddy, start, end);
+}
+
+static bool IsManagedType(uint64_t type)
+{
+    return type == LIMINE_MEMMAP_USABLE || type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE;
+}
+
+/*
+    SUBROUTINE:
+
+    * SetupZone()
+    * Places a zone's struct Page array at the start of its largest usable entry and hands it the usable memory.
+    * Returns false, leaving the zone offline, if no usable entry of the zone can hold the array.
+*/
+static bool SetupZone(enum ZoneType zone)
 {
-    uint64_t largestEntryLength = 0;
-    struct limine_memmap_entry largestEntry = {0};
+    struct Zone* z = &Zones[zone];
+    uint64_t largestStart = 0;
+    uint64_t largestLength = 0;
+
+    for (size_t i = 0; i < BootMemoryMap.entry_count; i++)
+    {
+        uint64_t start = BootMemoryMap.entries[i]->base;
+        uint64_t end = BootMemoryMap.entries[i]->base + BootMemoryMap.entries[i]->length;
+
+        if (BootMemoryMap.entries[i]->type != LIMINE_MEMMAP_USABLE) continue;
+        if (!ClipToZone(zone, &start, &end)) continue;
 
-    for (size_t i = 0; i < mmap.entry_count; i++)
-    {        
-        switch (mmap.entries[i]->type)
+        if (end - start > largestLength)
         {
-            case LIMINE_MEMMAP_USABLE:
-            {
-                if (mmap.entries[i]->length > largestEntryLength)
-                {
-                    largestEntryLength = mmap.entries[i]->length;
-                    largestEntry = *mmap.entries[i];
-                }
-            }
+            largestStart = start;
+            largestLength = end - start;
         }
     }
 
-    if (!largestEntry.length) panic("Detected no free memory!");
+    uint64_t metadataSize = ALIGN_UP(BuddyMetadataSize(z->start, z->end), FRAME_SIZE);
+    if (metadataSize >= largestLength) return false;
+
+    z->metadataStart = ALIGN_UP(largestStart, FRAME_SIZE);
+    z->metadataEnd = z->metadataStart + metadataSize;
+
+    /* Every frame starts out allocated, holes in the zone simply stay that way. */
+    struct Page* pages = (struct Page*)z->metadataStart;
+    uint64_t count = BuddyMetadataSize(z->start, z->end) / sizeof(struct Page);
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        pages[i] = (struct Page){ .zone = zone };
+    }
+
+    BuddyInitialize(&z->buddy, z->start, z->end, pages);
+
+    for (size_t i = 0; i < BootMemoryMap.entry_count; i++)
+    {
+        if (BootMemoryMap.entries[i]->type != LIMINE_MEMMAP_USABLE) continue;
+
+        AddRangeToZone(zone, BootMemoryMap.entries[i]->base, BootMemoryMap.entries[i]->base + BootMemoryMap.entries[i]->length);
+    }
+
+    z->online = true;
+    return true;
+}
+
+void InitializeAllocator(struct limine_memmap_response mmap)
+{
+    BootMemoryMap = mmap;
 
-    FrameList = (struct Page*)largestEntry.base;
-    uint64_t nextAddr = ALIGN_UP(largestEntry.base + (sizeof(struct Page) * (largestEntry.length / 0x1000)), 0x1000);
- 
-    for (size_t i = 0; i < largestEntry.length / 0x1000; i++)
+    /* Work out the span of each zone, reclaimable memory included since it joins later. */
+    for (enum ZoneType zone = 0; zone < ZONE_COUNT; zone++)
     {
-        struct Page newPage =
+        Zones[zone].start = UINT64_MAX;
+        Zones[zone].end = 0;
+
+        for (size_t i = 0; i < mmap.entry_count; i++)
         {
-            .ptr = (void*)nextAddr,
-            .free = true,
-        };
-        FrameList[i] = newPage;
-        nextAddr += 0x1000;
+            if (!IsManagedType(mmap.entries[i]->type)) continue;
+
+            uint64_t start = mmap.entries[i]->base;
+            uint64_t end = mmap.entries[i]->base + mmap.entries[i]->length;
+
+            if (!ClipToZone(zone, &start, &end)) continue;
+
+            if (start < Zones[zone].start) Zones[zone].start = start;
+            if (end > Zones[zone].end) Zones[zone].end = end;
+        }
     }
 
-    LargestMemSegSize = largestEntry.length;
+    /* 
+        Only DMA32 is set up now, as below 4GiB is all the bootloader identity maps before our own
+        page tables are loaded. NORMAL (array included) follows in OnlineNormalZone().
+    */
+    if (Zones[ZONE_DMA32].start >= Zones[ZONE_DMA32].end) panic("Detected no free memory!");
+
+    if (!SetupZone(ZONE_DMA32)) panic("Largest memory segment too small for the frame allocator!");
 }
 
-void* PageAlloc()
+/*
+    SUBROUTINE:
+
+    * OnlineNormalZone()
+    * Adds usable memory above 4GiB. Must be called once the kernel page tables identity map it.
+    * The zone is optional: if none of its entries can hold its struct Page array, the kernel runs
+    * on DMA32 alone.
+*/
+void OnlineNormalZone()
 {
-    for (size_t i = 0; i < LargestMemSegSize / 0x1000; i++)
+    if (Zones[ZONE_NORMAL].online || Zones[ZONE_NORMAL].start >= Zones[ZONE_NORMAL].end) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&Zones[ZONE_NORMAL].lock);
+    bool online = SetupZone(ZONE_NORMAL);
+    spinlock_release_irqrestore(&Zones[ZONE_NORMAL].lock, flags);
+
+    if (!online) serial_printf("[MM] Memory above 4GiB too fragmented for its frame metadata, left unused.\n");
+}
+
+/*
+    SUBROUTINE:
+
+    * ReclaimBootloaderMemory()
+    * Adds bootloader-reclaimable memory to the zones.
+    * Call only after every Limine response (the memory map included) has been consumed.
+    * The entry holding the current stack is kept, since the kernel still runs on the stack Limine gave it.
+*/
+void ReclaimBootloaderMemory()
+{
+    uint64_t starts[MAX_RECLAIM_RANGES];
+    uint64_t ends[MAX_RECLAIM_RANGES];
+    size_t count = 0;
+    uint64_t rsp;
+
+    asm volatile ("mov %%rsp, %0" : "=r"(rsp));
+
+    /* The memory map itself lives in reclaimable memory, so copy the ranges out first. */
+    for (size_t i = 0; i < BootMemoryMap.entry_count && count < MAX_RECLAIM_RANGES; i++)
+    {
+        uint64_t start = BootMemoryMap.entries[i]->base;
+        uint64_t end = BootMemoryMap.entries[i]->base + BootMemoryMap.entries[i]->length;
+
+        if (BootMemoryMap.entries[i]->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) continue;
+        if (rsp >= start && rsp < end) continue;
+
+        starts[count] = start;
+        ends[count] = end;
+        count++;
+    }
+
+    BootMemoryMap.entry_count = 0;
+    BootMemoryMap.entries = NULL;
+
+    for (size_t i = 0; i < count; i++)
     {
-        if (FrameList[i].free == true)
+        for (enum ZoneType zone = 0; zone < ZONE_COUNT; zone++)
         {
-            FrameList[i].free = false;
+            if (!Zones[zone].online) continue;
 
-            memset(FrameList[i].ptr, 0, 0x1000);
-            return FrameList[i].ptr;
+            uint64_t flags = spinlock_acquire_irqsave(&Zones[zone].lock);
+            AddRangeToZone(zone, starts[i], ends[i]);
+            spinlock_release_irqrestore(&Zones[zone].lock, flags);
         }
     }
+}
 
-    panic("No free mem left!");
-    return NULL;
+static enum ZoneType ZoneOf(void* addr)
+{
+    return ((uintptr_t)addr < DMA32_LIMIT) ? ZONE_DMA32 : ZONE_NORMAL;
 }
 
-void PageFree(void* addr)
+/*
+    SUBROUTINE:
+
+    * AddrToPage()
+    * Metadata entry of the frame containing addr, or NULL if the frame is not managed.
+*/
+struct Page* AddrToPage(void* addr)
+{
+    enum ZoneType zone = ZoneOf(addr);
+
+    if (!Zones[zone].online) return NULL;
+
+    return BuddyPage(&Zones[zone].buddy, (void*)ALIGN_DOWN((uintptr_t)addr, FRAME_SIZE));
+}
+
+/* Marks the head frame of a freshly allocated block as in use by one owner. */
+static void ClaimPage(void* addr, uint8_t order)
+{
+    struct Page* page = AddrToPage(addr);
+
+    page->refcount = 1;
+    page->flags = 0;
+    page->order = order;
+    page->owner = 0;
+}
+
+/*
+    SUBROUTINE:
+
+    * ReleasePage()
+    * Drops one reference to an allocated block. Returns true when the last one is gone and the block
+    * can go back to the allocator, false if it is still shared or was not a valid order-n allocation.
+*/
+static bool ReleasePage(void* addr, uint8_t order)
+{
+    struct Page* page = AddrToPage(addr);
+
+    if (!page || ((uintptr_t)addr % FRAME_SIZE)) return false;
+
+    if (!page->refcount || (page->flags & PAGE_FLAG_BUDDY))
+    {
+        KernelSoftError("Freeing a page frame that is not allocated");
+        return false;
+    }
+
+    if (page->order != order)
+    {
+        KernelSoftError("Freeing a page frame with the wrong size");
+        return false;
+    }
+
+    if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL)) return false;
+
+    page->flags = 0;
+    page->owner = 0;
+    return true;
+}
+
+/*
+    SUBROUTINE:
+
+    * PageRef()
+    * Takes an extra reference to an allocated block (shared or copy-on-write frames).
+    * Each reference is dropped with its own PageFree()/PageFreeOrder().
+*/
+void PageRef(void* addr)
+{
+    struct Page* page = AddrToPage(addr);
+
+    if (page && page->refcount) __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    SUBROUTINE:
+
+    * PageAllocZone()
+    * Allocates 2^order contiguous frames from one zone. Frames are not cleared, NULL is returned on failure.
+*/
+void* PageAllocZone(enum ZoneType zone, uint8_t order)
+{
+    if (zone >= ZONE_COUNT || !Zones[zone].online) return NULL;
+
+    uint64_t flags = spinlock_acquire_irqsave(&Zones[zone].lock);
+    void* ptr = BuddyAlloc(&Zones[zone].buddy, order);
+    spinlock_release_irqrestore(&Zones[zone].lock, flags);
+
+    if (ptr) ClaimPage(ptr, order);
+    return ptr;
+}
+
+/*
+    SUBROUTINE:
+
+    * RefillMagazine()
+    * Moves up to MAGAZINE_BATCH frames from the zones into a magazine, one lock acquisition per zone.
+*/
+static void RefillMagazine(struct FrameMagazine* mag)
+{
+    static const enum ZoneType preference[] = { ZONE_NORMAL, ZONE_DMA32 };
+
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]) && mag->count < MAGAZINE_BATCH; i++)
+    {
+        struct Zone* zone = &Zones[preference[i]];
+        if (!zone->online) continue;
+
+        spinlock_acquire_irqsoff(&zone->lock); // Interrupts are off, see FrameCacheAlloc()
+
+        while (mag->count < MAGAZINE_BATCH)
+        {
+            void* frame = BuddyAlloc(&zone->buddy, 0);
+            if (!frame) break;
+
+            mag->frames[mag->count++] = frame;
+        }
+
+        spinlock_release(&zone->lock);
+    }
+}
+
+/*
+    SUBROUTINE:
+
+    * DrainMagazine()
+    * Gives the oldest MAGAZINE_BATCH frames of a full magazine back to their zones.
+*/
+static void DrainMagazine(struct FrameMagazine* mag)
 {
-    for (size_t i = 0; i < LargestMemSegSize / 0x1000; i++)
+    for (enum ZoneType zone = 0; zone < ZONE_COUNT; zone++)
     {
-        if (FrameList[i].ptr == addr)
+        if (!Zones[zone].online) continue;
+
+        spinlock_acquire_irqsoff(&Zones[zone].lock); // Interrupts are off, see FrameCacheFree()
+
+        for (size_t i = 0; i < MAGAZINE_BATCH; i++)
         {
-            FrameList[i].free = true;
+            if (ZoneOf(mag->frames[i]) == zone) BuddyFree(&Zones[zone].buddy, mag->frames[i], 0);
         }
+
+        spinlock_release(&Zones[zone].lock);
+    }
+
+    mag->count -= MAGAZINE_BATCH;
+    memcpy(&mag->frames[0], &mag->frames[MAGAZINE_BATCH], mag->count * sizeof(void*));
+}
+
+/*
+    SUBROUTINE:
+
+    * FrameCacheAlloc()
+    * Pops a frame off this CPU's magazine, refilling it first if it ran dry.
+*/
+static void* FrameCacheAlloc()
+{
+    void* frame = NULL;
+    uint64_t flags = irq_save();
+
+    struct FrameMagazine* mag = &Magazines[GetCPUId()];
+
+    if (!mag->count) RefillMagazine(mag);
+    if (mag->count) frame = mag->frames[--mag->count];
+
+    irq_restore(flags);
+
+    if (frame) ClaimPage(frame, 0);
+    return frame;
+}
+
+static void FrameCacheFree(void* frame)
+{
+    uint64_t flags = irq_save();
+
+    struct FrameMagazine* mag = &Magazines[GetCPUId()];
+
+    if (mag->count == MAGAZINE_SIZE) DrainMagazine(mag);
+    mag->frames[mag->count++] = frame;
+
+    irq_restore(flags);
+}
+
+/*
+    SUBROUTINE:
+
+    * ZeroFrame()
+    * Clears a frame that is about to be used, with ordinary (cached) stores.
+*/
+static void ZeroFrame(void* frame)
+{
+    uint64_t count = FRAME_SIZE / sizeof(uint64_t);
+
+    asm volatile ( "rep stosq" : "+D"(frame), "+c"(count) : "a"((uint64_t)0) : "memory" );
+}
+
+void* PageAlloc()
+{
+    void* ptr = PageAllocTry();
+
+    if (!ptr) panic("No free mem left!");
+    return ptr;
+}
+
+/*
+    SUBROUTINE:
+
+    * PageAllocNoZero()
+    * PageAlloc() without clearing, for callers that overwrite the whole frame anyway.
+*/
+void* PageAllocNoZero()
+{
+    void* ptr = PageAllocNoZeroTry();
+
+    if (!ptr) panic("No free mem left!");
+    return ptr;
+}
+
+/*
+    SUBROUTINE:
+
+    * PageAllocTry()
+    * PageAlloc() for callers that can cope with running out of memory: NULL instead of a panic.
+*/
+void* PageAllocTry()
+{
+    void* ptr = ZeroPoolTake();
+    if (ptr) return ptr;
+
+    ptr = FrameCacheAlloc();
+    if (ptr) ZeroFrame(ptr);
+
+    return ptr;
+}
+
+/* PageAllocNoZero() returning NULL instead of panicking. */
+void* PageAllocNoZeroTry()
+{
+    return FrameCacheAlloc();
+}
+
+void PageFree(void* addr)
+{
+    if (ReleasePage(addr, 0)) FrameCacheFree(addr);
+}
+
+/*
+    SUBROUTINE:
+
+    * PageAllocOrder()
+    * Allocates 2^order physically contiguous frames, aligned to their total size.
+    * Unlike PageAlloc() the frames are not cleared, and NULL is returned instead of panicking.
+    * NORMAL is tried first so DMA32 memory is left for the devices that need it.
+*/
+void* PageAllocOrder(uint8_t order)
+{
+    void* ptr = PageAllocZone(ZONE_NORMAL, order);
+    if (!ptr) ptr = PageAllocZone(ZONE_DMA32, order);
+
+    return ptr;
+}
+
+void PageFreeOrder(void* addr, uint8_t order)
+{
+    enum ZoneType zone = ZoneOf(addr);
+
+    if (!ReleasePage(addr, order)) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&Zones[zone].lock);
+    BuddyFree(&Zones[zone].buddy, addr, order);
+    spinlock_release_irqrestore(&Zones[zone].lock, flags);
+}
+
+static uint8_t OrderForPageSize(PageSizes size)
+{
+    switch (size)
+    {
+        case _1G: return 18;
+        case _2M: return 9;
+        default: return 0;
     }
 }
+
+/*
+    SUBROUTINE:
+
+    * PageAllocSized()
+    * Allocates one physical frame of a paging size (4KiB, 2MiB or 1GiB), aligned to that size,
+    * ready to be passed to MapMemory() with the same size. Frames are not cleared, NULL is returned on failure.
+*/
+void* PageAllocSized(PageSizes size)
+{
+    return PageAllocOrder(OrderForPageSize(size));
+}
+
+void PageFreeSized(void* addr, PageSizes size)
+{
+    PageFreeOrder(addr, OrderForPageSize(size));
+}
+
+/*
+    SUBROUTINE:
+
+    * GetZoneStats()
+    * Snapshot of a zone's frame counters. Frames parked in magazines count as used here.
+*/
+void GetZoneStats(enum ZoneType zone, struct ZoneStats* stats)
+{
+    if (zone >= ZONE_COUNT) return;
+
+    *stats = (struct ZoneStats){ .name = Zones[zone].name };
+
+    if (!Zones[zone].online) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&Zones[zone].lock);
+
+    int largest = BuddyLargestFreeOrder(&Zones[zone].buddy);
+
+    stats->totalFrames = Zones[zone].buddy.totalPages;
+    stats->freeFrames = Zones[zone].buddy.freePages;
+    stats->largestFreeBlock = (largest < 0) ? 0 : ((uint64_t)1 << largest);
+
+    spinlock_release_irqrestore(&Zones[zone].lock, flags);
+}
+
+/*
+    SUBROUTINE:
+
+    * GetCachedFrames()
+    * Free frames held in per-CPU magazines, they are not on any zone free list.
+*/
+uint64_t GetCachedFrames()
+{
+    uint64_t count = 0;
+
+    for (size_t i = 0; i < MAX_CPUS; i++) count += Magazines[i].count;
+
+    return count;
+}
@@ -1,7 +1,37 @@
 #pragma once
 #include "../../limine.h"
+#include "../paging/paging.h"
+#include "page.h"
 #include <stdbool.h>
 
+enum ZoneType
+{
+    ZONE_DMA32 = 0, // Below 4GiB, for devices limited to 32-bit addresses
+    ZONE_NORMAL = 1,
+    ZONE_COUNT
+};
+
+struct ZoneStats
+{
+    const char* name;
+    uint64_t totalFrames;      // Frames managed by the zone
+    uint64_t freeFrames;       // Frames on the zone free lists
+    uint64_t largestFreeBlock; // Largest free buddy block, in frames, so the largest single allocation possible
+};
+
 void InitializeAllocator(struct limine_memmap_response mmap);
+void OnlineNormalZone();
+void ReclaimBootloaderMemory();
 void* PageAlloc();
+void* PageAllocNoZero();
+void* PageAllocTry();
+void* PageAllocNoZeroTry();
 void PageFree(void* addr);
+void* PageAllocOrder(uint8_t order);
+void PageFreeOrder(void* addr, uint8_t order);
+void* PageAllocZone(enum ZoneType zone, uint8_t order);
+void* PageAllocSized(PageSizes size);
+void PageFreeSized(void* addr, PageSizes size);
+void PageRef(void* addr);
+void GetZoneStats(enum ZoneType zone, struct ZoneStats* stats);
+uint64_t GetCachedFrames();
@@ -0,0 +1,237 @@
+/*
+    * buddy.c
+    * 
+    * ABSTRACT:
+    * 
+    *   -> Implements a binary buddy allocator over physical frames.
+    *   -> Allocating or freeing a block of order n costs at most BUDDY_MAX_ORDER - n splits or merges.
+    * 
+    * COPYRIGHT (C) 2023 DanielH
+    * This code along with the rest of this project is licensed under the MIT open-source license. A copy of the MIT license should be included in the source tree.
+    *
+*/
+
+#include "buddy.h"
+#include "../../util/memutil.h"
+
+static inline void* PfnToAddr(uint64_t pfn)
+{
+    return (void*)(pfn * BUDDY_FRAME_SIZE);
+}
+
+static inline struct Page* PfnToPage(struct BuddyAllocator* buddy, uint64_t pfn)
+{
+    return &buddy->pages[pfn - buddy->firstPfn];
+}
+
+/*
+    SUBROUTINE:
+
+    * IsFreeBlock()
+    * Tests whether the order-n block starting at pfn is free as a whole, and covered by this allocator.
+*/
+static inline bool IsFreeBlock(struct BuddyAllocator* buddy, uint64_t pfn, uint8_t order)
+{
+    if (pfn < buddy->firstPfn || pfn + ((uint64_t)1 << order) > buddy->endPfn) return false;
+
+    struct Page* page = PfnToPage(buddy, pfn);
+    return (page->flags & PAGE_FLAG_BUDDY) && page->order == order;
+}
+
+static void PushBlock(struct BuddyAllocator* buddy, uint64_t pfn, uint8_t order)
+{
+    struct BuddyBlock* block = PfnToAddr(pfn);
+    struct BuddyBlock* head = &buddy->freeLists[order];
+    struct Page* page = PfnToPage(buddy, pfn);
+
+    block->next = head->next;
+    block->prev = head;
+    head->next->prev = block;
+    head->next = block;
+
+    page->flags |= PAGE_FLAG_BUDDY;
+    page->order = order;
+    buddy->freeBlocks[order]++;
+    buddy->freePages += (uint64_t)1 << order;
+}
+
+static void UnlinkBlock(struct BuddyAllocator* buddy, uint64_t pfn, uint8_t order)
+{
+    struct BuddyBlock* block = PfnToAddr(pfn);
+
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+
+    PfnToPage(buddy, pfn)->flags &= ~PAGE_FLAG_BUDDY;
+    buddy->freeBlocks[order]--;
+    buddy->freePages -= (uint64_t)1 << order;
+}
+
+/*
+    SUBROUTINE:
+
+    * BuddyMetadataSize()
+    * Bytes of struct Page entries needed to manage [start, end).
+*/
+uint64_t BuddyMetadataSize(uint64_t start, uint64_t end)
+{
+    uint64_t firstPfn = start / BUDDY_FRAME_SIZE;
+    uint64_t endPfn = ALIGN_UP(end, BUDDY_FRAME_SIZE) / BUDDY_FRAME_SIZE;
+
+    return (endPfn - firstPfn) * sizeof(struct Page);
+}
+
+/*
+    SUBROUTINE:
+
+    * BuddyInitialize()
+    * Prepares an empty allocator able to manage [start, end). Memory is handed to it with BuddyAddRange().
+    * The caller initializes the page entries, every one of them starts out allocated.
+*/
+void BuddyInitialize(struct BuddyAllocator* buddy, uint64_t start, uint64_t end, struct Page* pages)
+{
+    buddy->firstPfn = start / BUDDY_FRAME_SIZE;
+    buddy->endPfn = ALIGN_UP(end, BUDDY_FRAME_SIZE) / BUDDY_FRAME_SIZE;
+    buddy->pages = pages;
+
+    for (uint8_t order = 0; order <= BUDDY_MAX_ORDER; order++)
+    {
+        buddy->freeLists[order].next = &buddy->freeLists[order];
+        buddy->freeLists[order].prev = &buddy->freeLists[order];
+        buddy->freeBlocks[order] = 0;
+    }
+
+    buddy->totalPages = 0;
+    buddy->freePages = 0;
+}
+
+/*
+    SUBROUTINE:
+
+    * BuddyPage()
+    * Metadata entry of the frame at addr, or NULL if this allocator does not cover it.
+*/
+struct Page* BuddyPage(struct BuddyAllocator* buddy, void* addr)
+{
+    uint64_t pfn = (uintptr_t)addr / BUDDY_FRAME_SIZE;
+
+    if (pfn < buddy->firstPfn || pfn >= buddy->endPfn) return NULL;
+
+    return PfnToPage(buddy, pfn);
+}
+
+/*
+    SUBROUTINE:
+
+    * BuddyAddRange()
+    * Releases [start, end) into the allocator as the largest aligned blocks that fit.
+*/
+void BuddyAddRange(struct BuddyAllocator* buddy, uint64_t start, uint64_t end)
+{
+    uint64_t pfn = ALIGN_UP(start, BUDDY_FRAME_SIZE) / BUDDY_FRAME_SIZE;
+    uint64_t endPfn = ALIGN_DOWN(end, BUDDY_FRAME_SIZE) / BUDDY_FRAME_SIZE;
+
+    while (pfn < endPfn)
+    {
+        uint8_t order = BUDDY_MAX_ORDER;
+
+        while (order && ((pfn & (((uint64_t)1 << order) - 1)) || pfn + ((uint64_t)1 << order) > endPfn)) order--;
+
+        BuddyFree(buddy, PfnToAddr(pfn), order);
+        buddy->totalPages += (uint64_t)1 << order;
+        pfn += (uint64_t)1 << order;
+    }
+}
+
+/*
+    SUBROUTINE:
+
+    * BuddyAlloc()
+    * Allocates 2^order contiguous frames, splitting a larger block if needed. Returns NULL when none is left.
+*/
+void* BuddyAlloc(struct BuddyAllocator* buddy, uint8_t order)
+{
+    if (order > BUDDY_MAX_ORDER) return NULL;
+
+    uint8_t found = order;
+    while (found <= BUDDY_MAX_ORDER && !buddy->freeBlocks[found]) found++;
+
+    if (found > BUDDY_MAX_ORDER) return NULL;
+
+    uint64_t pfn = (uintptr_t)buddy->freeLists[found].next / BUDDY_FRAME_SIZE;
+    UnlinkBlock(buddy, pfn, found);
+
+    /* Give the upper halves back until the block is the requested size. */
+    while (found > order)
+    {
+        found--;
+        PushBlock(buddy, pfn + ((uint64_t)1 << found), found);
+    }
+
+    return PfnToAddr(pfn);
+}
+
+/*
+    SUBROUTINE:
+
+    * BuddyFree()
+    * Returns a block of 2^order frames, merging it with its buddy for as long as the buddy is free.
+*/
+void BuddyFree(struct BuddyAllocator* buddy, void* addr, uint8_t order)
+{
+    uint64_t pfn = (uintptr_t)addr / BUDDY_FRAME_SIZE;
+
+    if ((uintptr_t)addr % BUDDY_FRAME_SIZE) return;
+    if (order > BUDDY_MAX_ORDER) return;
+    if (pfn < buddy->firstPfn || pfn + ((uint64_t)1 << order) > buddy->endPfn) return;
+    if (pfn & (((uint64_t)1 << order) - 1)) return;
+
+    /* Already free, ignore the double free. */
+    if (PfnToPage(buddy, pfn)->flags & PAGE_FLAG_BUDDY) return;
+
+    while (order < BUDDY_MAX_ORDER)
+    {
+        uint64_t buddyPfn = pfn ^ ((uint64_t)1 << order);
+
+        if (!IsFreeBlock(buddy, buddyPfn, order)) break;
+
+        UnlinkBlock(buddy, buddyPfn, order);
+
+        if (buddyPfn < pfn) pfn = buddyPfn;
+        order++;
+    }
+
+    PushBlock(buddy, pfn, order);
+}
+
+/*
+    SUBROUTINE:
+
+    * BuddyOrderForPages()
+    * Smallest order whose block holds at least n pages.
+*/
+uint8_t BuddyOrderForPages(uint64_t pages)
+{
+    uint8_t order = 0;
+
+    while (((uint64_t)1 << order) < pages) order++;
+
+    return order;
+}
+
+/*
+    SUBROUTINE:
+
+    * BuddyLargestFreeOrder()
+    * Order of the largest free block, or -1 if nothing is free.
+    * Free buddies are always merged, so this is the largest contiguous run an allocation can get.
+*/
+int BuddyLargestFreeOrder(struct BuddyAllocator* buddy)
+{
+    for (int order = BUDDY_MAX_ORDER; order >= 0; order--)
+    {
+        if (buddy->freeBlocks[order]) return order;
+    }
+
+    return -1;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "page.h"
+
+/*
+    * buddy.h
+    * Binary buddy allocator for physically contiguous, naturally aligned runs of 4KiB frames.
+    * A block of order n is 2^n frames long and its physical address is aligned to its own size.
+*/
+
+#define BUDDY_FRAME_SIZE 0x1000
+#define BUDDY_MAX_ORDER 18 // 2^18 frames = 1GiB
+
+/* Free blocks are linked through their own first bytes (memory is identity mapped). */
+struct BuddyBlock
+{
+    struct BuddyBlock* next;
+    struct BuddyBlock* prev;
+};
+
+struct BuddyAllocator
+{
+    uint64_t firstPfn; // First frame covered
+    uint64_t endPfn;   // One past the last frame covered
+
+    /* One entry per frame in [firstPfn, endPfn). Free block heads carry PAGE_FLAG_BUDDY and their order. */
+    struct Page* pages;
+
+    struct BuddyBlock freeLists[BUDDY_MAX_ORDER + 1];
+    uint64_t freeBlocks[BUDDY_MAX_ORDER + 1];
+
+    uint64_t totalPages; // Frames ever handed to the allocator
+    uint64_t freePages;  // Frames currently on the free lists
+};
+
+uint64_t BuddyMetadataSize(uint64_t start, uint64_t end);
+void BuddyInitialize(struct BuddyAllocator* buddy, uint64_t start, uint64_t end, struct Page* pages);
+void BuddyAddRange(struct BuddyAllocator* buddy, uint64_t start, uint64_t end);
+void* BuddyAlloc(struct BuddyAllocator* buddy, uint8_t order);
+void BuddyFree(struct BuddyAllocator* buddy, void* addr, uint8_t order);
+struct Page* BuddyPage(struct BuddyAllocator* buddy, void* addr);
+uint8_t BuddyOrderForPages(uint64_t pages);
+int BuddyLargestFreeOrder(struct BuddyAllocator* buddy);
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+/*
+    * page.h
+    * Per-frame metadata. Every managed 4KiB frame has one entry, found by its page frame number (PFN).
+    * Entries are 16 bytes, so four share a cache line.
+*/
+
+#define PAGE_FLAG_BUDDY     (1 << 0) // Head of a free buddy block, block size in .order
+#define PAGE_FLAG_PINNED    (1 << 1) // Must stay at this physical address (DMA, etc)
+#define PAGE_FLAG_PAGETABLE (1 << 2) // Holds a paging structure, a PML4 keeps its PCID in .owner
+#define PAGE_FLAG_SLAB      (1 << 3) // Owned by a slab cache, see .owner
+
+struct Page
+{
+    uint32_t refcount; // 0 while free
+    uint16_t flags;
+    uint8_t zone;
+    uint8_t order;     // Order of the block this frame heads, if it heads one
+    uint64_t owner;    // Subsystem specific, e.g. the owning slab cache
+};
+
+_Static_assert(sizeof(struct Page) == 16, "struct Page must stay 16 bytes");
+
+struct Page* AddrToPage(void* addr);
@@ -0,0 +1,105 @@
+/*
+    * zeropool.c
+    * 
+    * ABSTRACT:
+    * 
+    *   -> Keeps a pool of frames that are already cleared, so PageAlloc() does not have to zero
+    *   -> memory on the hot path. The pool is refilled when the CPU would otherwise be idle.
+    * 
+    * COPYRIGHT (C) 2023 DanielH
+    * This code along with the rest of this project is licensed under the MIT open-source license. A copy of the MIT license should be included in the source tree.
+    *
+*/
+
+#include "zeropool.h"
+#include <stddef.h>
+#include <stdint.h>
+#include "allocator.h"
+#include "../../multitasking/spinlock.h"
+
+#define FRAME_SIZE 0x1000
+#define ZERO_POOL_SIZE 256 // 1MiB of cleared frames
+
+void* ZeroPool[ZERO_POOL_SIZE] = {0};
+uint64_t ZeroPoolCount = 0;
+INIT_SPINLOCK(ZeroPoolLock);
+
+/*
+    SUBROUTINE:
+
+    * ZeroFrameNonTemporal()
+    * Clears a frame with non-temporal stores, so refilling the pool does not evict useful cache lines.
+*/
+static void ZeroFrameNonTemporal(void* frame)
+{
+    uint64_t* p = frame;
+    uint64_t count = FRAME_SIZE / 32;
+
+    asm volatile (
+        "1:\n"
+        "movnti %2, 0(%0)\n"
+        "movnti %2, 8(%0)\n"
+        "movnti %2, 16(%0)\n"
+        "movnti %2, 24(%0)\n"
+        "add $32, %0\n"
+        "dec %1\n"
+        "jnz 1b\n"
+        "sfence\n"
+        : "+r"(p), "+r"(count)
+        : "r"((uint64_t)0)
+        : "memory"
+    );
+}
+
+/*
+    SUBROUTINE:
+
+    * ZeroPoolTake()
+    * Returns a cleared frame, or NULL if the pool is empty.
+*/
+void* ZeroPoolTake()
+{
+    void* frame = NULL;
+    uint64_t flags = spinlock_acquire_irqsave(&ZeroPoolLock);
+
+    if (ZeroPoolCount) frame = ZeroPool[--ZeroPoolCount];
+
+    spinlock_release_irqrestore(&ZeroPoolLock, flags);
+    return frame;
+}
+
+/*
+    SUBROUTINE:
+
+    * ZeroPoolRefill()
+    * Tops the pool up. Meant for the idle loop: clearing runs with interrupts enabled, and the
+    * lock is only held to push each finished frame.
+*/
+void ZeroPoolRefill()
+{
+    while (ZeroPoolCount < ZERO_POOL_SIZE)
+    {
+        void* frame = PageAllocOrder(0);
+        if (!frame) return;
+
+        ZeroFrameNonTemporal(frame);
+
+        uint64_t flags = spinlock_acquire_irqsave(&ZeroPoolLock);
+
+        bool full = ZeroPoolCount == ZERO_POOL_SIZE;
+        if (!full) ZeroPool[ZeroPoolCount++] = frame;
+
+        spinlock_release_irqrestore(&ZeroPoolLock, flags);
+
+        if (full)
+        {
+            PageFreeOrder(frame, 0);
+            return;
+        }
+    }
+}
+
+uint64_t ZeroPoolSize()
+{
+    return ZeroPoolCount;
+}
@@ -0,0 +1,6 @@
+#pragma once
+#include <stdint.h>
+
+void* ZeroPoolTake();
+void ZeroPoolRefill();
+uint64_t ZeroPoolSize();
@@ -1,17 +1,23 @@
 /*
     * heap.c
-    * 
+    *
     * ABSTRACT:
-    * 
+    *
     *   -> Implements malloc() and free()
-    * 
+    *   -> Every block carries its size at both ends (boundary tags), so free() merges a block with
+    *   -> free neighbours immediately. Free blocks sit on segregated lists, one per power-of-two size
+    *   -> class, with a bitmap of non-empty classes for finding a fit without walking the heap.
+    *   -> Large allocations bypass the heap and get their own pages mapped in kernel address space.
+    *   -> Each CPU allocates from its own arena. A block freed on another CPU is pushed onto its arena's
+    *   -> lock-free remote-free list, which the owning CPU drains, so malloc()/free() take no locks.
+    *
     * COPYRIGHT (C) 2023 DanielH
     * This code along with the rest of this project is licensed under the MIT open-source license. A copy of the MIT license should be included in the source tree.
-    * 
+    *
     * Macros KSTATUS, KSTATUS_FAIL, KSTATUS_SUCCESS:
     *   -> Signal to kernel caller wether operation has been successful or not.
     *   -> Defined in system14.h
-    * 
+    *
     * HISTORY
     *   -> 2023 DanielH created
     *
@@ -19,107 +25,389 @@
 
 #include "heap.h"
 #include <stddef.h>
+#include <stdbool.h>
 #include "../allocator/allocator.h"
+#include "../allocator/buddy.h"
+#include "../vmm/vmm.h"
 #include "../../system14.h"
+#include "../../system/error.h"
+#include "../../multitasking/spinlock.h"
+#include "../../system/percpu.h"
 #include "../../util/memutil.h"
+#include "../../util/print.h"
+
+/*
+    Chunk layout (a run of frames taken from the frame allocator):
+
+    | HeapChunk | block | block | ... | epilogue |
+
+    The chunk ends in the prologue footer and the epilogue is a bare header, both marked used,
+    so coalescing stops at chunk edges without any bounds checks.
+*/
+
+#define HEAP_ALIGN 16
+#define HEAP_USED 1
+#define HEAP_MAGIC 0x4B48454150424C00 // Stored in allocated blocks with the owning arena in the low byte
+#define HEAP_ARENA_MASK 0xFF
+#define HEAP_HEADER_SIZE 16
+#define HEAP_FOOTER_SIZE 8
+#define HEAP_MIN_BLOCK 48         // Header, free list links and footer
+#define HEAP_BUCKETS 32           // Bucket n holds blocks of [2^(n+5), 2^(n+6)) bytes
+#define HEAP_MIN_CHUNK_ORDER 2    // Grow the heap by at least 16KiB at a time
+#define HEAP_MAX_ALLOC (1ULL << 40)
+
+#define HEAP_PROFILE_CLASSES 48 // Request sizes, class n holds [2^(n-1), 2^n), the last one anything larger
+#define HEAP_PROFILE_SITES 256  // Call sites tracked, must be a power of two
+
+#define BLOCK_SIZE(b) ((b)->size & ~(uint64_t)HEAP_USED)
+#define BLOCK_USED(b) ((b)->size & HEAP_USED)
+
+struct HeapChunk
+{
+    uint64_t order;
+    uint64_t prologue; // Footer of a used, zero sized block
+};
+
+struct HeapBlock
+{
+    uint64_t size;  // Whole block, tags included. Low bit set while allocated.
+    uint64_t magic;
+
+    /* Only valid while the block is free, they are the first bytes of the payload otherwise. */
+    struct HeapBlock* next;
+    struct HeapBlock* prev;
+};
 
-struct HeapNode
+/* Only touched by its own CPU with interrupts off, except for remoteFree. */
+struct HeapArena
 {
-    uint64_t size;
-    struct HeapNode* next;
+    struct HeapBlock* buckets[HEAP_BUCKETS];
+    uint32_t bucketMap; // Bit n set while buckets[n] is not empty
+    struct HeapStats stats;
+
+    /* Blocks freed by other CPUs, linked through ->next. On its own cache line, it is the one shared field. */
+    _Alignas(64) struct HeapBlock* _Atomic remoteFree;
+}__attribute__((aligned(64)));
+
+struct HeapArena Arenas[MAX_CPUS] = {0};
+uint64_t largeBytes = 0;
+uint64_t heapHighWater = HEAP_DEFAULT_HIGH_WATER;
+
+#ifdef HEAP_PROFILE
+struct HeapProfileSite
+{
+    void* site; // Return address of the malloc()/calloc()/... call
+    uint64_t allocs;
+    uint64_t bytes;
 };
 
-struct HeapNode head = {0};
+struct HeapProfileSite profileSites[HEAP_PROFILE_SITES] = {0};
+uint64_t profileClassAllocs[HEAP_PROFILE_CLASSES] = {0};
+uint64_t profileClassBytes[HEAP_PROFILE_CLASSES] = {0};
+uint64_t profileDropped = 0; // Allocations from call sites that did not fit in the table
 
 /*
     SUBROUTINE:
 
-    * CreateNode()
-    * Inserts a node.
+    * HeapProfileRecord()
+    * Counts an allocation against its size class and its call site. Sites live in an open addressed
+    * table that is claimed with compare-and-swap, so any CPU may record without a lock.
 */
-void CreateNode(void* addr, uint64_t size)
+static void HeapProfileRecord(uint64_t size, void* site)
 {
-    struct HeapNode* newNode = (struct HeapNode*)addr;
+    uint32_t class = size ? 64 - __builtin_clzll(size) : 0;
+    if (class >= HEAP_PROFILE_CLASSES) class = HEAP_PROFILE_CLASSES - 1; // Recorded before the size is validated
 
-    newNode->next = head.next;
-    newNode->size = size;
+    __atomic_add_fetch(&profileClassAllocs[class], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profileClassBytes[class], size, __ATOMIC_RELAXED);
 
-    head.next = newNode;
+    // Fibonacci hashing, the top bits of the product index the table.
+    uint32_t slot = ((uint64_t)site * 0x9E3779B97F4A7C15) >> (64 - __builtin_ctz(HEAP_PROFILE_SITES));
+
+    for (uint32_t probe = 0; probe < HEAP_PROFILE_SITES; probe++, slot = (slot + 1) & (HEAP_PROFILE_SITES - 1))
+    {
+        struct HeapProfileSite* entry = &profileSites[slot];
+        void* current = __atomic_load_n(&entry->site, __ATOMIC_ACQUIRE);
+
+        if (!current && __atomic_compare_exchange_n(&entry->site, &current, site, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            current = site;
+        }
+
+        if (current != site) continue;
+
+        __atomic_add_fetch(&entry->allocs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&entry->bytes, size, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_add_fetch(&profileDropped, 1, __ATOMIC_RELAXED);
+}
+
+#define PROFILE_ALLOC(size) HeapProfileRecord((size), __builtin_return_address(0))
+#else
+#define PROFILE_ALLOC(size) ((void)0)
+#endif
+
+static inline uint64_t* Footer(struct HeapBlock* block)
+{
+    return (uint64_t*)((uint8_t*)block + BLOCK_SIZE(block) - HEAP_FOOTER_SIZE);
+}
+
+static inline void SetTags(struct HeapBlock* block, uint64_t size, bool used)
+{
+    block->size = size | (used ? HEAP_USED : 0);
+    *Footer(block) = block->size;
+}
+
+static inline uint32_t BucketOf(uint64_t size)
+{
+    uint32_t bucket = 63 - __builtin_clzll(size) - 5;
+
+    return bucket < HEAP_BUCKETS ? bucket : HEAP_BUCKETS - 1;
 }
 
 /*
     SUBROUTINE:
 
-    * CombineBlocks()
-    * Combines many pages to create a large block.
+    * InsertFree()
+    * Marks a block free and puts it on the list for its size class.
 */
-KSTATUS CombineBlocks(uint64_t size)
+static void InsertFree(struct HeapArena* arena, struct HeapBlock* block, uint64_t size)
+{
+    uint32_t bucket = BucketOf(size);
+
+    SetTags(block, size, false);
+    block->magic = 0;
+
+    block->prev = NULL;
+    block->next = arena->buckets[bucket];
+    if (block->next) block->next->prev = block;
+
+    arena->buckets[bucket] = block;
+    arena->bucketMap |= 1U << bucket;
+    arena->stats.freeNodes++;
+}
+
+static void RemoveFree(struct HeapArena* arena, struct HeapBlock* block)
 {
-    void* initial = PageAlloc();
-    int numPages = 0;
+    uint32_t bucket = BucketOf(BLOCK_SIZE(block));
+
+    if (block->prev) block->prev->next = block->next;
+    else arena->buckets[bucket] = block->next;
 
-    for (size_t i = 0; i < size; i += 4096)
+    if (block->next) block->next->prev = block->prev;
+
+    if (!arena->buckets[bucket]) arena->bucketMap &= ~(1U << bucket);
+    arena->stats.freeNodes--;
+}
+
+/*
+    SUBROUTINE:
+
+    * Coalesce()
+    * Merges a block that is about to become free with its free neighbours, which are taken off their
+    * lists. Returns the start of the merged block and its size in *size.
+*/
+static struct HeapBlock* Coalesce(struct HeapArena* arena, struct HeapBlock* block, uint64_t* size)
+{
+    struct HeapBlock* next = (struct HeapBlock*)((uint8_t*)block + *size);
+    uint64_t prevTag = *(uint64_t*)((uint8_t*)block - HEAP_FOOTER_SIZE);
+
+    if (!BLOCK_USED(next))
     {
-        if (!PageAlloc())
-        {
-            // End of memory, we free all used pages and then fail.
-            for (int i = numPages; i > 0; i--)
-            {
-                PageFree(initial + (4096 * i));
-            }
+        RemoveFree(arena, next);
+        *size += BLOCK_SIZE(next);
+    }
 
-            return KSTATUS_FAIL;
-        }
-        numPages++;
+    if (!(prevTag & HEAP_USED))
+    {
+        struct HeapBlock* prev = (struct HeapBlock*)((uint8_t*)block - prevTag);
+
+        RemoveFree(arena, prev);
+        *size += prevTag;
+        block = prev;
     }
 
-    CreateNode(initial, (numPages * 4096));
+    return block;
+}
+
+/*
+    SUBROUTINE:
+
+    * GrowHeap()
+    * Takes a chunk of frames large enough for a block of the given size and frees it into the heap.
+*/
+static KSTATUS GrowHeap(struct HeapArena* arena, uint64_t size)
+{
+    uint64_t pages = ALIGN_UP(size + sizeof(struct HeapChunk) + HEAP_HEADER_SIZE, 4096) / 4096;
+    uint8_t order = BuddyOrderForPages(pages);
+
+    if (order < HEAP_MIN_CHUNK_ORDER) order = HEAP_MIN_CHUNK_ORDER;
+    if (order > BUDDY_MAX_ORDER) return KSTATUS_FAIL;
+
+    // malloc() memory is not cleared, calloc() clears only what it returns.
+    struct HeapChunk* chunk = PageAllocOrder(order);
+    if (!chunk) return KSTATUS_FAIL;
+
+    uint64_t bytes = (uint64_t)4096 << order;
+
+    chunk->order = order;
+    chunk->prologue = HEAP_USED;
+
+    struct HeapBlock* epilogue = (struct HeapBlock*)((uint8_t*)chunk + bytes - HEAP_HEADER_SIZE);
+    epilogue->size = HEAP_USED;
+
+    arena->stats.heapBytes += bytes;
+    InsertFree(arena, (struct HeapBlock*)(chunk + 1), bytes - sizeof(struct HeapChunk) - HEAP_HEADER_SIZE);
     return KSTATUS_SUCCESS;
 }
 
+/* A free block spans its whole chunk when it sits between the prologue and the epilogue. */
+static inline bool IsWholeChunk(struct HeapBlock* block)
+{
+    uint64_t prevTag = *(uint64_t*)((uint8_t*)block - HEAP_FOOTER_SIZE);
+    struct HeapBlock* next = (struct HeapBlock*)((uint8_t*)block + BLOCK_SIZE(block));
+
+    return prevTag == HEAP_USED && next->size == HEAP_USED;
+}
+
 /*
     SUBROUTINE:
 
-    * FindAndRemoveNode()
-    * Finds a suitable node for given size.
+    * ReleaseChunk()
+    * Gives a chunk back to the frame allocator if it is entirely free and the heap holds more free
+    * memory than the high-water mark. The block must be off the free lists. Returns true if released.
 */
-struct HeapNode* FindAndRemoveNode(uint64_t size)
+static bool ReleaseChunk(struct HeapArena* arena, struct HeapBlock* block)
 {
-    struct HeapNode* current = &head;
+    if (arena->stats.heapBytes - arena->stats.bytesInUse <= heapHighWater || !IsWholeChunk(block)) return false;
 
-    while (1)
+    struct HeapChunk* chunk = (struct HeapChunk*)block - 1;
+    uint8_t order = chunk->order;
+
+    arena->stats.heapBytes -= (uint64_t)4096 << order;
+    PageFreeOrder(chunk, order);
+    return true;
+}
+
+/*
+    SUBROUTINE:
+
+    * FindFree()
+    * Finds a free block of at least size bytes. Blocks in the size's own class may be too small and
+    * are checked first fit, any block in a larger class fits and the first one is taken.
+*/
+static struct HeapBlock* FindFree(struct HeapArena* arena, uint64_t size)
+{
+    uint32_t bucket = BucketOf(size);
+
+    for (struct HeapBlock* block = arena->buckets[bucket]; block; block = block->next)
     {
-        if (current->next == NULL)
-        {
-            if ((size + sizeof(struct HeapNode)) >= 4096)
-            {
-                if (CombineBlocks(size) == KSTATUS_FAIL) return NULL;
-                current = &head;
-                continue;
-            }
-            else
-            {
-                void* newblock = PageAlloc();
+        if (BLOCK_SIZE(block) >= size) return block;
+    }
 
-                if (newblock) CreateNode(newblock, 4096);
-                else return NULL;
-            }
-        }
+    uint32_t larger = bucket + 1 < HEAP_BUCKETS ? arena->bucketMap & ~((2U << bucket) - 1) : 0;
+    if (!larger) return NULL;
 
-        // Node is large enough to fit the structure and the process requested size
-        if ((sizeof(struct HeapNode) + size) <= current->next->size)
-        {
-            void* ret = current->next;
-            // Unlink the node
-            current->next = current->next->next;
+    return arena->buckets[__builtin_ctz(larger)];
+}
 
-            return ret;
-        }
+/*
+    SUBROUTINE:
+
+    * Split()
+    * Shrinks a used block to size bytes when the remainder can stand as a free block of its own.
+*/
+static void Split(struct HeapArena* arena, struct HeapBlock* block, uint64_t size)
+{
+    uint64_t extraSize = BLOCK_SIZE(block) - size;
+
+    if (extraSize < HEAP_MIN_BLOCK) return;
+
+    SetTags(block, size, true);
+
+    struct HeapBlock* extra = (struct HeapBlock*)((uint8_t*)block + size);
+    extra = Coalesce(arena, extra, &extraSize);
+    InsertFree(arena, extra, extraSize);
+}
+
+/* Block size needed for a payload of size bytes. */
+static inline uint64_t BlockSizeFor(uint64_t size)
+{
+    uint64_t blockSize = ALIGN_UP(size + HEAP_HEADER_SIZE + HEAP_FOOTER_SIZE, HEAP_ALIGN);
+
+    return blockSize < HEAP_MIN_BLOCK ? HEAP_MIN_BLOCK : blockSize;
+}
+
+static inline bool IsHeapBlock(struct HeapBlock* block)
+{
+    return (block->magic & ~(uint64_t)HEAP_ARENA_MASK) == HEAP_MAGIC &&
+           (block->magic & HEAP_ARENA_MASK) < MAX_CPUS &&
+           BLOCK_USED(block);
+}
+
+static inline struct HeapArena* ArenaOf(struct HeapBlock* block)
+{
+    return &Arenas[block->magic & HEAP_ARENA_MASK];
+}
+
+/* Frees a block of this arena. Interrupts must be off. */
+static void FreeBlock(struct HeapArena* arena, struct HeapBlock* block)
+{
+    uint64_t size = BLOCK_SIZE(block);
+    arena->stats.bytesInUse -= size;
+
+    // Merging into a free left neighbour leaves this header inside the merged block, it must not
+    // look allocated there.
+    block->magic = 0;
+    SetTags(block, size, false);
+
+    block = Coalesce(arena, block, &size);
+    SetTags(block, size, false);
+
+    if (!ReleaseChunk(arena, block)) InsertFree(arena, block, size);
+}
+
+/*
+    SUBROUTINE:
+
+    * DrainRemoteFrees()
+    * Frees the blocks other CPUs handed back to this arena. The whole list is taken in one exchange,
+    * so pushes racing with it land on the next drain. Interrupts must be off.
+*/
+static void DrainRemoteFrees(struct HeapArena* arena)
+{
+    struct HeapBlock* block = __atomic_exchange_n(&arena->remoteFree, NULL, __ATOMIC_ACQUIRE);
 
-        current = current->next;
+    while (block)
+    {
+        struct HeapBlock* next = block->next;
+
+        FreeBlock(arena, block);
+        block = next;
     }
+}
+
+/* Hands a block to the arena that owns it. Safe from any CPU. */
+static void PushRemoteFree(struct HeapArena* arena, struct HeapBlock* block)
+{
+    struct HeapBlock* head = __atomic_load_n(&arena->remoteFree, __ATOMIC_RELAXED);
 
-    return NULL;
+    do
+    {
+        block->next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remoteFree, &head, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* The running CPU's arena, with remote frees folded back in. Interrupts must be off. */
+static struct HeapArena* LocalArena()
+{
+    struct HeapArena* arena = &Arenas[GetCPUId()];
+
+    if (__atomic_load_n(&arena->remoteFree, __ATOMIC_RELAXED)) DrainRemoteFrees(arena);
+
+    return arena;
 }
 
 /*
@@ -130,23 +418,68 @@ struct HeapNode* FindAndRemoveNode(uint64_t size)
 */
 void* _alloc(size_t size, size_t alignment)
 {
-    struct HeapNode* node = FindAndRemoveNode(size + (alignment - 1));
-    if (!node) return NULL;
+    if (size > HEAP_MAX_ALLOC || alignment > HEAP_MAX_ALLOC) return NULL;
+    if (alignment < HEAP_ALIGN) alignment = HEAP_ALIGN;
+
+    // Falls through to a physically contiguous chunk if address space or frames run out.
+    if (size >= HEAP_LARGE_THRESHOLD && alignment <= 4096)
+    {
+        void* large = KernelVmAlloc(size);
+
+        if (large)
+        {
+            __atomic_add_fetch(&largeBytes, KernelVmSize(large), __ATOMIC_RELAXED);
+            return large;
+        }
+    }
 
-    uintptr_t base = (uintptr_t)node + sizeof(struct HeapNode); // Preserve the struct for adding it again in the future.
-    uintptr_t base_align = ALIGN_UP(base, alignment);
+    uint64_t blockSize = BlockSizeFor(size);
 
-    uintptr_t end = base_align + size;
-    uintptr_t innerSize = node->size - sizeof(struct HeapNode);
-    uintptr_t extraSize = innerSize - size;
+    // Over-aligned requests need room to cut a free block off the front.
+    uint64_t searchSize = blockSize;
+    if (alignment > HEAP_ALIGN) searchSize += alignment + HEAP_MIN_BLOCK;
 
-    if (extraSize > 0) 
+    uint64_t flags = irq_save();
+    struct HeapArena* arena = LocalArena();
+
+    struct HeapBlock* block = FindFree(arena, searchSize);
+
+    if (!block)
     {
-        CreateNode((void*)end, extraSize);
-        node->size -= extraSize;
+        if (GrowHeap(arena, searchSize) == KSTATUS_FAIL)
+        {
+            irq_restore(flags);
+            return NULL;
+        }
+
+        block = FindFree(arena, searchSize);
     }
 
-    return (void*)base;
+    RemoveFree(arena, block);
+    SetTags(block, BLOCK_SIZE(block), true);
+
+    uintptr_t base = (uintptr_t)block + HEAP_HEADER_SIZE;
+
+    if (base % alignment)
+    {
+        uintptr_t aligned = ALIGN_UP(base + HEAP_MIN_BLOCK, alignment);
+        uint64_t front = aligned - base;
+        uint64_t rest = BLOCK_SIZE(block) - front;
+
+        // The block's left neighbour is in use, free blocks never sit next to each other.
+        InsertFree(arena, block, front);
+
+        block = (struct HeapBlock*)((uint8_t*)block + front);
+        SetTags(block, rest, true);
+    }
+
+    Split(arena, block, blockSize);
+    block->magic = HEAP_MAGIC | (arena - Arenas);
+
+    arena->stats.bytesInUse += BLOCK_SIZE(block);
+
+    irq_restore(flags);
+    return (uint8_t*)block + HEAP_HEADER_SIZE;
 }
 
 /*
@@ -157,6 +490,7 @@ void* _alloc(size_t size, size_t alignment)
 */
 void* malloc(size_t size)
 {
+    PROFILE_ALLOC(size);
     return _alloc(size, 1);
 }
 
@@ -168,9 +502,8 @@ void* malloc(size_t size)
 */
 void* aligned_alloc(size_t alignment, size_t size)
 {
-    void* node = _alloc(size, alignment);
-    if (!node) return NULL;
-    return (void*)ALIGN_UP((uintptr_t)node, alignment);
+    PROFILE_ALLOC(size);
+    return _alloc(size, alignment);
 }
 
 /*
@@ -181,13 +514,100 @@ void* aligned_alloc(size_t alignment, size_t size)
 */
 void* calloc(size_t size)
 {
-    void* r = malloc(size);
+    PROFILE_ALLOC(size);
+    void* r = _alloc(size, 1);
 
     if (r) memset(r, 0, size);
 
     return r;
 }
 
+/*
+    LIBRARY EXPORT:
+
+    * realloc()
+    * Resizes an allocation. Shrinks in place, grows in place into a free right neighbour when it is
+    * large enough, and only otherwise moves the data to a new block.
+*/
+void* realloc(void* addr, size_t size)
+{
+    if (size) PROFILE_ALLOC(size);
+
+    if (!addr) return _alloc(size, 1);
+
+    if (!size)
+    {
+        free(addr);
+        return NULL;
+    }
+
+    if (size > HEAP_MAX_ALLOC) return NULL;
+
+    if (KernelVmContains(addr))
+    {
+        uint64_t largeSize = KernelVmSize(addr);
+        if (size <= largeSize) return addr;
+
+        void* moved = _alloc(size, 1);
+        if (!moved) return NULL;
+
+        memcpy(moved, addr, largeSize);
+        free(addr);
+
+        return moved;
+    }
+
+    struct HeapBlock* block = (struct HeapBlock*)((uint8_t*)addr - HEAP_HEADER_SIZE);
+
+    if (!IsHeapBlock(block))
+    {
+        KernelSoftError("realloc() of a pointer that is not an allocated heap block");
+        return NULL;
+    }
+
+    uint64_t blockSize = BlockSizeFor(size);
+    uint64_t oldSize = BLOCK_SIZE(block);
+
+    uint64_t flags = irq_save();
+    struct HeapArena* arena = LocalArena();
+
+    // Resizing in place changes the owner's free lists, which only the owning CPU may do.
+    if (ArenaOf(block) != arena)
+    {
+        irq_restore(flags);
+        if (blockSize <= oldSize) return addr;
+    }
+    else
+    {
+        struct HeapBlock* next = (struct HeapBlock*)((uint8_t*)block + oldSize);
+
+        if (blockSize > oldSize && !BLOCK_USED(next) && oldSize + BLOCK_SIZE(next) >= blockSize)
+        {
+            RemoveFree(arena, next);
+            SetTags(block, oldSize + BLOCK_SIZE(next), true);
+        }
+
+        if (blockSize <= BLOCK_SIZE(block))
+        {
+            Split(arena, block, blockSize);
+
+            arena->stats.bytesInUse += BLOCK_SIZE(block) - oldSize;
+            irq_restore(flags);
+            return addr;
+        }
+
+        irq_restore(flags);
+    }
+
+    void* moved = _alloc(size, 1);
+    if (!moved) return NULL;
+
+    memcpy(moved, addr, oldSize - HEAP_HEADER_SIZE - HEAP_FOOTER_SIZE);
+    free(addr);
+
+    return moved;
+}
+
 /*
     LIBRARY EXPORT:
 
@@ -196,7 +616,147 @@ void* calloc(size_t size)
 */
 void free(void* addr)
 {
-    struct HeapNode* prevNode = (void*)(uintptr_t)addr - sizeof(struct HeapNode);
+    if (!addr) return;
+
+    if (KernelVmContains(addr))
+    {
+        __atomic_sub_fetch(&largeBytes, KernelVmSize(addr), __ATOMIC_RELAXED);
+        KernelVmFree(addr);
+        return;
+    }
+
+    struct HeapBlock* block = (struct HeapBlock*)((uint8_t*)addr - HEAP_HEADER_SIZE);
+
+    if (!IsHeapBlock(block))
+    {
+        KernelSoftError("free() of a pointer that is not an allocated heap block");
+        return;
+    }
+
+    struct HeapArena* owner = ArenaOf(block);
+    block->magic = 0; // A second free() of this pointer fails IsHeapBlock() from here on
+
+    uint64_t flags = irq_save();
+    struct HeapArena* arena = LocalArena();
+
+    if (owner == arena) FreeBlock(arena, block);
+    else PushRemoteFree(owner, block);
+
+    irq_restore(flags);
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * HeapTrim()
+    * Releases entirely free chunks of this CPU's arena until its free memory is back under the
+    * high-water mark. free() already releases the chunk it empties, this catches chunks emptied while
+    * under the mark.
+*/
+void HeapTrim()
+{
+    uint64_t flags = irq_save();
+    struct HeapArena* arena = LocalArena();
+
+    // Chunks are at least 2^HEAP_MIN_CHUNK_ORDER frames, so smaller classes never hold a whole one.
+    for (uint32_t bucket = BucketOf(4096 << HEAP_MIN_CHUNK_ORDER) - 1; bucket < HEAP_BUCKETS; bucket++)
+    {
+        struct HeapBlock* block = arena->buckets[bucket];
+
+        while (block && arena->stats.heapBytes - arena->stats.bytesInUse > heapHighWater)
+        {
+            struct HeapBlock* next = block->next;
+
+            if (IsWholeChunk(block))
+            {
+                RemoveFree(arena, block);
+                ReleaseChunk(arena, block);
+            }
+
+            block = next;
+        }
+    }
+
+    irq_restore(flags);
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * HeapSetHighWaterMark()
+    * Sets how many bytes of free memory each arena keeps before whole free chunks go back to the
+    * frame allocator.
+*/
+void HeapSetHighWaterMark(uint64_t bytes)
+{
+    heapHighWater = bytes;
+    HeapTrim();
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * GetHeapStats()
+    * Snapshot of the heap counters, summed over all arenas. Other CPUs keep running, so the sum is
+    * only approximate.
+*/
+void GetHeapStats(struct HeapStats* stats)
+{
+    stats->heapBytes = 0;
+    stats->bytesInUse = 0;
+    stats->freeNodes = 0;
+    stats->largeBytes = largeBytes;
+
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        stats->heapBytes += Arenas[cpu].stats.heapBytes;
+        stats->bytesInUse += Arenas[cpu].stats.bytesInUse;
+        stats->freeNodes += Arenas[cpu].stats.freeNodes;
+    }
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * HeapProfileDump()
+    * Prints the allocation histogram and the call site table to the serial port. Only available in
+    * HEAP_PROFILE builds (make HEAP_PROFILE=1), the profiler costs nothing otherwise.
+*/
+void HeapProfileDump()
+{
+#ifdef HEAP_PROFILE
+    serial_printf("[HEAPPROF] ----------------------------------------\n");
+    serial_printf("[HEAPPROF] Requests by size class:\n");
+
+    for (uint32_t class = 0; class < HEAP_PROFILE_CLASSES; class++)
+    {
+        if (!profileClassAllocs[class]) continue;
+
+        bool last = class == HEAP_PROFILE_CLASSES - 1; // Open ended, from 2^(class-1) up
+
+        serial_printf("[HEAPPROF]   %s 0x%x bytes: %d allocations, %d KiB\n",
+                      last ? ">=" : "<",
+                      (uintptr_t)1 << (last ? class - 1 : class),
+                      (int)profileClassAllocs[class],
+                      (int)(profileClassBytes[class] / 1024));
+    }
+
+    serial_printf("[HEAPPROF] Call sites (resolve with addr2line -e kernel.elf):\n");
+
+    for (uint32_t slot = 0; slot < HEAP_PROFILE_SITES; slot++)
+    {
+        struct HeapProfileSite* entry = &profileSites[slot];
+        if (!entry->site || !entry->allocs) continue;
+
+        serial_printf("[HEAPPROF]   0x%x: %d allocations, %d KiB, %d bytes average\n",
+                      (uintptr_t)entry->site,
+                      (int)entry->allocs,
+                      (int)(entry->bytes / 1024),
+                      (int)(entry->bytes / entry->allocs));
+    }
 
-    CreateNode(prevNode, prevNode->size);
+    if (profileDropped) serial_printf("[HEAPPROF] %d allocations from untracked call sites\n", (int)profileDropped);
+#else
+    serial_printf("[HEAPPROF] Heap profiling is not compiled in, rebuild with make HEAP_PROFILE=1\n");
+#endif
 }
@@ -2,7 +2,23 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#define HEAP_DEFAULT_HIGH_WATER (256 * 1024) // Free heap bytes kept before chunks are released
+#define HEAP_LARGE_THRESHOLD (64 * 1024)     // Allocations this large are mapped by the VMM
+
+struct HeapStats
+{
+    uint64_t heapBytes;  // Bytes taken from the frame allocator
+    uint64_t bytesInUse; // Bytes handed out, block headers included
+    uint64_t freeNodes;  // Free blocks across all size classes
+    uint64_t largeBytes; // Bytes in large allocations mapped by the VMM, not counted above
+};
+
 void* malloc(uint64_t size);
 void* calloc(uint64_t size);
+void* realloc(void* addr, size_t size);
 void free(void* addr);
 void* aligned_alloc(size_t alignment, size_t size);
+void GetHeapStats(struct HeapStats* stats);
+void HeapTrim();
+void HeapSetHighWaterMark(uint64_t bytes);
+void HeapProfileDump();
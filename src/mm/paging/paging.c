@@ -32,8 +32,36 @@
 #include "../../util/string.h"
 #include "../../system/cpuid_.h"
 #include "../../util/print.h"
+#include "../../util/cr.h"
+#include "../../util/msr.h"
+#include "../../multitasking/spinlock.h"
+#include "../../system/error.h"
+#include "../../system/panic.h"
+
+#define LOW_MAPPING_END 0x100000000 // Identity and HHDM mappings always cover the first 4GiB
+#define KERNEL_HALF_FIRST_ENTRY 256  // PML4 entries 256-511 map the upper half
 
 struct PT* pml4 = { 0 };
+uint64_t pageTablePages = 0;
+bool gbPages = false; // CPU can map 1GiB pages
+
+/* Segment boundaries of the kernel image, see config/kernel.ld */
+extern uint8_t kernelStart[];
+extern uint8_t kernelRodataStart[];
+extern uint8_t kernelDataStart[];
+
+/*
+    * PCIDs tag TLB entries with the address space they came from, so loading CR3 need not flush.
+    * PCID 0 is what the boot CR3 runs under and is never handed out. A PML4 holds
+    * (generation << 12) | pcid in the .owner of its struct Page, and a tag from an older generation
+    * is stale: the PML4 gets a fresh PCID on its next load. Within a generation, numbers are only
+    * handed out once, and wrapping around flushes every PCID before any number is reused.
+*/
+#define PCID_MAX 0xFFF
+
+bool pcids = false; // CR4.PCIDE is set
+uint64_t pcidGeneration = 1;
+uint64_t nextPCID = 1;
 
 /* 
     * STRUCTURE GlobalPagingInfo
@@ -51,6 +79,40 @@ struct
     uintptr_t fbSize;
 } GlobalPagingInfo;
 
+/*
+    * Paging structures come from the frame allocator, whose pointers are physical addresses: all RAM
+    * is identity mapped (see CreateDefaultMappings()), while our HHDM window only covers 4GiB. Nothing
+    * else converts between a table or frame and what an entry stores.
+*/
+static inline uint64_t TableToPhys(struct PT* table)
+{
+    return (uint64_t)table;
+}
+
+static inline struct PT* EntryToTable(struct PTE* entry)
+{
+    return (struct PT*)((uint64_t)entry->PhysAddr << 12);
+}
+
+/* Physical address a leaf entry maps. Bit 12 of a large page entry is its PAT bit, not address. */
+static inline uint64_t LeafPhys(struct PTE* entry, uint64_t pageBytes)
+{
+    return ((uint64_t)entry->PhysAddr << 12) & ~(pageBytes - 1);
+}
+
+/*
+    * PAT entries 0-3 in the order of CacheTypes, 4-7 left at their power-on values. Only entry 1
+    * differs from the default, write-combining instead of write-through, which nothing used.
+*/
+#define PAT_VALUE 0x0007040600070106ULL
+
+/* Sets the PAT index of an entry. The PAT bit itself (index bit 2) is never needed. */
+static inline void SetCacheType(struct PTE* entry, CacheTypes cache)
+{
+    entry->PLWriteThrough = (cache & 1) ? 0b1 : 0b0;
+    entry->PLCacheDisable = (cache & 2) ? 0b1 : 0b0;
+}
+
 /*
     SUBROUTINE:
 
@@ -68,6 +130,7 @@ int is_aligned(uint64_t addr, uint64_t boundary)
 
     * GetEntryNextLevel()
     * Allocates and gives you a pointer to the next level down in the page tables.
+    * NULL if a large page is in the way or no frame is left for a new table.
 */
 struct PT* GetEntryNextLevel(struct PT *curr_level, size_t entry)
 {
@@ -76,12 +139,23 @@ struct PT* GetEntryNextLevel(struct PT *curr_level, size_t entry)
         return NULL;
     }
 
+    // A large page maps this whole range, there is no table below it to walk into.
+    if (curr_level->values[entry].Present && curr_level->values[entry].PageSize)
+    {
+        return NULL;
+    }
+
     if (!curr_level->values[entry].Present)
     {
-        void* newalloc = PageAlloc();
+        void* newalloc = PageAllocTry();
+        if (!newalloc) return NULL;
+
         assert(is_aligned((uintptr_t)newalloc, 4096));
 
-        curr_level->values[entry].PhysAddr = ((uint64_t)newalloc >> 12);
+        AddrToPage(newalloc)->flags |= PAGE_FLAG_PAGETABLE;
+        pageTablePages++;
+
+        curr_level->values[entry].PhysAddr = TableToPhys(newalloc) >> 12;
         curr_level->values[entry].Present = 0b1;
         curr_level->values[entry].RW = 0b1;
 
@@ -89,7 +163,7 @@ struct PT* GetEntryNextLevel(struct PT *curr_level, size_t entry)
     }
     else
     {
-        return (struct PT*)(uint64_t)(curr_level->values[entry].PhysAddr << 12);
+        return EntryToTable(&curr_level->values[entry]);
     }
 
     /* unreachable */
@@ -102,10 +176,12 @@ struct PT* GetEntryNextLevel(struct PT *curr_level, size_t entry)
     * MapMemory()
     * Maps a physical address to a virtual address.
 */
-KSTATUS MapMemory(struct PT* tgtPml4, uint64_t virt, uint64_t phys, PageSizes size, bool user)
+KSTATUS MapMemory(struct PT* tgtPml4, uint64_t virt, uint64_t phys, PageSizes size, bool user, CacheTypes cache)
 {
     assert(is_aligned(virt, 4096));
     assert(is_aligned(phys, 4096));
+    if (size == _2M) assert(is_aligned(virt | phys, 0x200000));
+    if (size == _1G) assert(is_aligned(virt | phys, 0x40000000));
 
     size_t pml4_entry = (virt & ((uint64_t)0x1FF << 39)) >> 39;
     size_t pdpt_entry = (virt & ((uint64_t)0x1FF << 30)) >> 30;
@@ -117,7 +193,12 @@ KSTATUS MapMemory(struct PT* tgtPml4, uint64_t virt, uint64_t phys, PageSizes si
     struct PT* t;
     size_t index;
 
-    if (size == _2M)
+    if (size == _1G)
+    {
+        t = pdpt;
+        index = pdpt_entry;
+    }
+    else if (size == _2M)
     {
         t = GetEntryNextLevel(pdpt, pdpt_entry);
         index = pd_entry;
@@ -141,104 +222,600 @@ KSTATUS MapMemory(struct PT* tgtPml4, uint64_t virt, uint64_t phys, PageSizes si
     t->values[index].RW = 0b1;
     t->values[index].PhysAddr = ((uint64_t)phys >> 12);
     
-    if (size == _2M) t->values[index].PageSize = 0b1;
+    if (size != _4K) t->values[index].PageSize = 0b1;
     if (user)        t->values[index].UserSupervisor = 0b1;
 
+    SetCacheType(&t->values[index], cache);
+
     return KSTATUS_SUCCESS;
 }
 
+/* Bytes covered by one page of the given size. */
+static inline uint64_t PageBytes(PageSizes size)
+{
+    return (uint64_t)0x1000 << (9 * size);
+}
+
 /*
-    * SUBROUTINE
+    SUBROUTINE:
 
-    * CreateDefaultMappings(struct PT*)
-    * Creates default kernel/hhdm/framebuffer mappings
+    * LargestFit()
+    * Largest page size that both addresses are aligned to and that fits in the remaining length.
 */
-void CreateDefaultMappings(struct PT* targetPML4)
+static PageSizes LargestFit(uint64_t virt, uint64_t phys, uint64_t remaining, uint32_t flags)
 {
-    // Map the kernel
-    for (uintptr_t i = 0; i < GlobalPagingInfo.kernelSize; i += 4096)
+    if (flags & MAP_4K_ONLY) return _4K;
+
+    if (gbPages && is_aligned(virt | phys, PageBytes(_1G)) && remaining >= PageBytes(_1G)) return _1G;
+    if (is_aligned(virt | phys, PageBytes(_2M)) && remaining >= PageBytes(_2M)) return _2M;
+
+    return _4K;
+}
+
+/*
+    SUBROUTINE:
+
+    * GetLeafTable()
+    * Walks down to the table that holds entries for pages of the given size, allocating tables on
+    * the way. NULL if a large page is in the way.
+*/
+static struct PT* GetLeafTable(struct PT* tgtPml4, uint64_t virt, PageSizes size)
+{
+    struct PT* table = tgtPml4;
+
+    for (int level = 3; level > (int)size; level--)
     {
-        MapMemory(targetPML4, GlobalPagingInfo.kernelVirtBase + i, GlobalPagingInfo.kernelPhysBase + i, _4K, false);
+        table = GetEntryNextLevel(table, (virt >> (12 + 9 * level)) & 0x1FF);
     }
 
-    // 0-2MiB
-    for (uint64_t i = 0; i < 0x200000; i += 4096)
+    return table;
+}
+
+/*
+    SUBROUTINE:
+
+    * GetLeafEntry()
+    * Walks the tables without allocating. Returns the entry that maps virt, which is a large page
+    * entry if the walk ends above the PT level, or NULL if virt is not mapped. *size is set to the
+    * size of the page the entry maps, or of the range the missing entry would have covered.
+*/
+static struct PTE* GetLeafEntry(struct PT* tgtPml4, uint64_t virt, PageSizes* size)
+{
+    struct PT* table = tgtPml4;
+
+    for (int level = 3; level > 0; level--)
     {
-        if (i)
+        struct PTE* entry = &table->values[(virt >> (12 + 9 * level)) & 0x1FF];
+
+        if (size) *size = (level == 3) ? _1G : (PageSizes)level; // A missing PML4 entry is skipped 1GiB at a time
+        if (!entry->Present) return NULL;
+        if (entry->PageSize) return entry;
+
+        table = EntryToTable(entry);
+    }
+
+    struct PTE* entry = &table->values[(virt >> 12) & 0x1FF];
+
+    if (size) *size = _4K;
+    return entry->Present ? entry : NULL;
+}
+
+static inline void invlpg(uint64_t virt)
+{
+    asm volatile ( "invlpg (%0)" : : "r"(virt) : "memory" );
+}
+
+/*
+    SUBROUTINE:
+
+    * FlushAllContexts()
+    * Toggling CR4.PGE drops every TLB entry, of every PCID, global ones included.
+*/
+static void FlushAllContexts()
+{
+    uint64_t cr4 = read_cr4();
+
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+}
+
+/*
+    SUBROUTINE:
+
+    * RetireAddressSpaces()
+    * Makes every PCID tag stale after a change to shared tables, so each address space starts from
+    * a clean PCID on its next load. Numbers already handed out are not reused until the wrap flush.
+*/
+void RetireAddressSpaces()
+{
+    if (pcids) pcidGeneration++;
+}
+
+/*
+    SUBROUTINE:
+
+    * TlbBatchInit()
+    * Starts an empty batch. Everything gathered in it is flushed by TlbBatchFlush().
+*/
+void TlbBatchInit(struct TlbBatch* batch)
+{
+    batch->count = 0;
+    batch->global = false;
+    batch->local = false;
+    batch->frames = NULL;
+}
+
+/* Records a page whose entry was removed or changed. */
+static void TlbBatchAdd(struct TlbBatch* batch, uint64_t virt, bool global)
+{
+    if (batch->count < TLB_FLUSH_THRESHOLD) batch->pages[batch->count] = virt;
+    batch->count++;
+
+    if (global) batch->global = true;
+    else batch->local = true;
+}
+
+/*
+    SUBROUTINE:
+
+    * TlbBatchFreeFrame()
+    * Frees a frame once the batch is flushed, as a stale TLB entry may still reach it until then.
+    * The frame is linked into the batch through its first word.
+*/
+void TlbBatchFreeFrame(struct TlbBatch* batch, uint64_t phys)
+{
+    *(void**)phys = batch->frames;
+    batch->frames = (void*)phys;
+}
+
+/*
+    SUBROUTINE:
+
+    * TlbBatchFlush()
+    * Makes one flush decision for everything gathered: invlpg per page up to TLB_FLUSH_THRESHOLD
+    * pages, a full flush above it. Then frees the batch's frames and empties it.
+*/
+void TlbBatchFlush(struct TlbBatch* batch)
+{
+    if (batch->count > TLB_FLUSH_THRESHOLD)
+    {
+        // A CR3 reload keeps global entries, only toggling CR4.PGE drops them.
+        if (batch->global) FlushAllContexts();
+        else cr3load(read_cr3() & ~CR3_NOFLUSH);
+    }
+    else
+    {
+        for (uint64_t i = 0; i < batch->count; i++) invlpg(batch->pages[i]);
+    }
+
+    // Both flushes above drop global entries from every PCID but other entries only from this one,
+    // and other address spaces sharing the tables may still cache them.
+    if (batch->local) RetireAddressSpaces();
+
+    while (batch->frames)
+    {
+        void* frame = batch->frames;
+
+        batch->frames = *(void**)frame;
+        PageFree(frame);
+    }
+
+    TlbBatchInit(batch);
+}
+
+/*
+    SUBROUTINE:
+
+    * UnmapMemory()
+    * Removes a 4KiB mapping. The physical address it pointed to is returned in *phys (if not NULL)
+    * so the caller can free the frame. Paging structures are kept. The flush is gathered in batch,
+    * or done right away if batch is NULL.
+*/
+KSTATUS UnmapMemory(struct PT* tgtPml4, uint64_t virt, uint64_t* phys, struct TlbBatch* batch)
+{
+    struct PTE* entry = GetLeafEntry(tgtPml4, virt, NULL);
+
+    if (!entry || entry->PageSize) return KSTATUS_FAIL;
+
+    if (phys) *phys = LeafPhys(entry, PageBytes(_4K));
+
+    struct TlbBatch single;
+    if (!batch)
+    {
+        batch = &single;
+        TlbBatchInit(batch);
+    }
+
+    TlbBatchAdd(batch, virt, entry->Global);
+    *(uint64_t*)entry = 0;
+
+    if (batch == &single) TlbBatchFlush(batch);
+
+    return KSTATUS_SUCCESS;
+}
+
+/*
+    SUBROUTINE:
+
+    * UnmapRange()
+    * Removes every mapping in [virt, virt + len), skipping holes. Large pages must lie entirely
+    * inside the range, they are not split. Frames are not freed. The flush is gathered in batch.
+*/
+KSTATUS UnmapRange(struct PT* tgtPml4, uint64_t virt, uint64_t len, struct TlbBatch* batch)
+{
+    assert(is_aligned(virt, 4096));
+
+    uint64_t end = virt + ALIGN_UP(len, 4096);
+
+    while (virt < end)
+    {
+        PageSizes size;
+        struct PTE* entry = GetLeafEntry(tgtPml4, virt, &size);
+        uint64_t next = ALIGN_DOWN(virt, PageBytes(size)) + PageBytes(size);
+
+        if (entry)
         {
-            MapMemory(targetPML4, i, i, _4K, false);
+            if (virt != next - PageBytes(size) || next > end)
+            {
+                KernelSoftError("Unmapping part of a large page");
+                return KSTATUS_FAIL;
+            }
+
+            TlbBatchAdd(batch, virt, entry->Global);
+            *(uint64_t*)entry = 0;
         }
 
-        MapMemory(targetPML4, GlobalPagingInfo.hhdm_base + i, i, _4K, false);
+        virt = next;
     }
 
-    // 2MiB-4GiB
-    for (uint64_t i = 0x200000; i < 0x40000000; i += 0x200000)
+    return KSTATUS_SUCCESS;
+}
+
+/*
+    SUBROUTINE:
+
+    * ProtectRange()
+    * Changes the MAP_WRITE, MAP_USER and MAP_GLOBAL permissions of every mapping in
+    * [virt, virt + len), skipping holes. Large pages must lie entirely inside the range. The flush
+    * is gathered in batch.
+*/
+KSTATUS ProtectRange(struct PT* tgtPml4, uint64_t virt, uint64_t len, uint32_t flags, struct TlbBatch* batch)
+{
+    assert(is_aligned(virt, 4096));
+
+    uint64_t end = virt + ALIGN_UP(len, 4096);
+
+    while (virt < end)
     {
-        MapMemory(targetPML4, i, i, _2M, false);
-        MapMemory(targetPML4, GlobalPagingInfo.hhdm_base + i, i, _2M, false);
+        PageSizes size;
+        struct PTE* entry = GetLeafEntry(tgtPml4, virt, &size);
+        uint64_t next = ALIGN_DOWN(virt, PageBytes(size)) + PageBytes(size);
+
+        if (entry)
+        {
+            if (virt != next - PageBytes(size) || next > end)
+            {
+                KernelSoftError("Protecting part of a large page");
+                return KSTATUS_FAIL;
+            }
+
+            // Either side being global means other address spaces may hold the old entry.
+            TlbBatchAdd(batch, virt, entry->Global || (flags & MAP_GLOBAL));
+
+            entry->RW = (flags & MAP_WRITE) ? 0b1 : 0b0;
+            entry->UserSupervisor = (flags & MAP_USER) ? 0b1 : 0b0;
+            entry->Global = (flags & MAP_GLOBAL) ? 0b1 : 0b0;
+        }
+
+        virt = next;
     }
 
-    for (uint64_t i = 0x40000000; i < 0x100000000; i += 0x1000)
+    return KSTATUS_SUCCESS;
+}
+
+/*
+    SUBROUTINE:
+
+    * VirtToPhys()
+    * Translates virt through the given tables, whatever the size of the page mapping it. One walk,
+    * no allocation. Fails if virt is not mapped.
+*/
+KSTATUS VirtToPhys(struct PT* tgtPml4, uint64_t virt, uint64_t* phys)
+{
+    PageSizes size;
+    struct PTE* entry = GetLeafEntry(tgtPml4, virt, &size);
+
+    if (!entry) return KSTATUS_FAIL;
+
+    *phys = LeafPhys(entry, PageBytes(size)) | (virt & (PageBytes(size) - 1));
+    return KSTATUS_SUCCESS;
+}
+
+/*
+    SUBROUTINE:
+
+    * WalkTable()
+    * Visits the leaves of one table that fall in [virt, last], descending into the tables below it.
+    * level is 3 for a PML4 down to 0 for a PT. The range is inclusive so it can end at the top of
+    * the address space. Returns false once the callback asks to stop.
+*/
+static bool WalkTable(struct PT* table, int level, uint64_t virt, uint64_t last, WalkCallback callback, void* context)
+{
+    uint64_t span = PageBytes((PageSizes)level); // Bytes behind one entry of this table
+
+    while (1)
     {
-        MapMemory(targetPML4, i, i, _4K, false);
-        MapMemory(targetPML4, GlobalPagingInfo.hhdm_base + i, i, _4K, false);
+        struct PTE* entry = &table->values[(virt >> (12 + 9 * level)) & 0x1FF];
+        uint64_t pieceLast = ALIGN_DOWN(virt, span) + span - 1;
+
+        if (pieceLast > last) pieceLast = last;
+
+        if (entry->Present)
+        {
+            if (level == 0 || entry->PageSize)
+            {
+                uint64_t phys = LeafPhys(entry, span) | (virt & (span - 1));
+
+                if (!callback(virt, phys, pieceLast - virt + 1, entry, context)) return false;
+            }
+            else if (!WalkTable(EntryToTable(entry), level - 1, virt, pieceLast, callback, context)) return false;
+        }
+
+        if (pieceLast == last) return true;
+        virt = pieceLast + 1;
     }
+}
 
-    // Map the other memory sections (fix for ACPI)
-    for (size_t i = 0; i < GlobalPagingInfo.mmap.entry_count; i++)
+/*
+    SUBROUTINE:
+
+    * WalkRange()
+    * Calls callback for every mapped piece of [virt, virt + len) in address order, in a single
+    * traversal of the tables. A piece is one page, or the part of a large page inside the range, so
+    * pieces can be 4KiB, 2MiB or 1GiB long. Holes are skipped. Fails if the callback stopped the walk.
+*/
+KSTATUS WalkRange(struct PT* tgtPml4, uint64_t virt, uint64_t len, WalkCallback callback, void* context)
+{
+    if (!len) return KSTATUS_SUCCESS;
+    if (!WalkTable(tgtPml4, 3, virt, virt + len - 1, callback, context)) return KSTATUS_FAIL;
+
+    return KSTATUS_SUCCESS;
+}
+
+/*
+    SUBROUTINE:
+
+    * MapRange()
+    * Maps len bytes (rounded up to 4KiB) of physical memory at phys to virt. Uses the largest page
+    * size alignment allows, walks the tables once per table touched rather than once per page and
+    * fills consecutive entries in place. Where a table already exists below an entry its mappings
+    * are kept and the range is mapped inside it with smaller pages.
+*/
+KSTATUS MapRange(struct PT* tgtPml4, uint64_t virt, uint64_t phys, uint64_t len, uint32_t flags)
+{
+    assert(is_aligned(virt, 4096));
+    assert(is_aligned(phys, 4096));
+
+    uint64_t end = virt + ALIGN_UP(len, 4096);
+
+    while (virt < end)
     {
-        for (uintptr_t j = GlobalPagingInfo.mmap.entries[i]->base; j < GlobalPagingInfo.mmap.entries[i]->base + GlobalPagingInfo.mmap.entries[i]->length; j += 4096)
+        PageSizes size = LargestFit(virt, phys, end - virt, flags);
+        struct PT* table;
+        size_t index;
+
+        while (1)
         {
-            if (j % 4096 != 0) continue;
-            MapMemory(targetPML4, j, j, _4K, false);
+            table = GetLeafTable(tgtPml4, virt, size);
+            if (!table) return KSTATUS_FAIL;
+
+            index = (virt >> (12 + 9 * size)) & 0x1FF;
+
+            struct PTE* entry = &table->values[index];
+            if (size == _4K || !entry->Present || entry->PageSize) break;
+
+            size--;
         }
+
+        // Fill this table until the range, the table or the current page size runs out.
+        do
+        {
+            struct PTE* entry = &table->values[index];
+
+            *(uint64_t*)entry = 0;
+            entry->Present = 0b1;
+            entry->RW = (flags & MAP_WRITE) ? 0b1 : 0b0;
+            entry->UserSupervisor = (flags & MAP_USER) ? 0b1 : 0b0;
+            entry->Global = (flags & MAP_GLOBAL) ? 0b1 : 0b0;
+            entry->PageSize = (size != _4K) ? 0b1 : 0b0;
+            entry->PhysAddr = phys >> 12;
+            SetCacheType(entry, MAP_CACHE_TYPE(flags));
+
+            virt += PageBytes(size);
+            phys += PageBytes(size);
+            index++;
+        } while (index < 512 &&
+                 virt < end &&
+                 LargestFit(virt, phys, end - virt, flags) == size &&
+                 (size == _4K || !table->values[index].Present || table->values[index].PageSize));
+    }
+
+    return KSTATUS_SUCCESS;
+}
+
+/*
+    SUBROUTINE:
+
+    * MapLowWindow()
+    * Maps physical [start, 4GiB) at virtOffset + start. The framebuffer is cut out and mapped
+    * write-combining, so that no mapping of it disagrees on the memory type.
+*/
+static void MapLowWindow(struct PT* targetPML4, uint64_t virtOffset, uint64_t start)
+{
+    uint64_t fbStart = ALIGN_DOWN(GlobalPagingInfo.fbBase - GlobalPagingInfo.hhdm_base, 4096);
+    uint64_t fbEnd = ALIGN_UP(GlobalPagingInfo.fbBase - GlobalPagingInfo.hhdm_base + GlobalPagingInfo.fbSize, 4096);
+
+    if (fbStart < start || fbStart >= LOW_MAPPING_END)
+    {
+        MapRange(targetPML4, virtOffset + start, start, LOW_MAPPING_END - start, MAP_WRITE);
+        return;
+    }
+
+    if (fbEnd > LOW_MAPPING_END) fbEnd = LOW_MAPPING_END;
+
+    MapRange(targetPML4, virtOffset + start, start, fbStart - start, MAP_WRITE);
+    MapRange(targetPML4, virtOffset + fbStart, fbStart, fbEnd - fbStart, MAP_WRITE | MAP_CACHE(CACHE_WC));
+    MapRange(targetPML4, virtOffset + fbEnd, fbEnd, LOW_MAPPING_END - fbEnd, MAP_WRITE);
+}
+
+/*
+    * SUBROUTINE
+
+    * CreateDefaultMappings(struct PT*)
+    * Creates default kernel/hhdm/framebuffer mappings
+*/
+void CreateDefaultMappings(struct PT* targetPML4)
+{
+    // Map the kernel, one segment at a time. Segments start on 2MiB boundaries, so if Limine placed
+    // the image on one too they get 2MiB pages. Global, as every address space shares them.
+    uint64_t text = GlobalPagingInfo.kernelVirtBase;
+    uint64_t rodata = text + (kernelRodataStart - kernelStart);
+    uint64_t data = text + (kernelDataStart - kernelStart);
+    uint64_t physOffset = GlobalPagingInfo.kernelPhysBase - text;
+
+    MapRange(targetPML4, text, text + physOffset, rodata - text, MAP_GLOBAL);
+    MapRange(targetPML4, rodata, rodata + physOffset, data - rodata, MAP_GLOBAL);
+    MapRange(targetPML4, data, data + physOffset, GlobalPagingInfo.kernelSize - (data - text), MAP_WRITE | MAP_GLOBAL);
+
+    // 0-4GiB, identity (without the null page) and HHDM. 1GiB pages from 1GiB up if the CPU has them.
+    MapLowWindow(targetPML4, 0, 0x1000);
+    MapLowWindow(targetPML4, GlobalPagingInfo.hhdm_base, 0);
+
+    // Map the other memory sections (fix for ACPI). Everything below 4GiB is mapped already.
+    for (size_t i = 0; i < GlobalPagingInfo.mmap.entry_count; i++)
+    {
+        uintptr_t base = GlobalPagingInfo.mmap.entries[i]->base;
+        uintptr_t end = base + GlobalPagingInfo.mmap.entries[i]->length;
+
+        if (base < LOW_MAPPING_END) base = LOW_MAPPING_END;
+        base = ALIGN_UP(base, 4096);
+
+        uint32_t cache = (GlobalPagingInfo.mmap.entries[i]->type == LIMINE_MEMMAP_FRAMEBUFFER) ? MAP_CACHE(CACHE_WC) : 0;
+
+        if (base < end) MapRange(targetPML4, base, base, end - base, MAP_WRITE | cache);
     }
 
-    // Map framebuffer
-    for (uintptr_t i = GlobalPagingInfo.fbBase; 
-                   i < GlobalPagingInfo.fbBase + GlobalPagingInfo.fbSize;
-                   i += 4096)
+    // Map framebuffer write-combining, unless it sits in the HHDM window mapped above
+    if (GlobalPagingInfo.fbBase - GlobalPagingInfo.hhdm_base >= LOW_MAPPING_END)
     {
-        MapMemory(targetPML4, i, i - GlobalPagingInfo.hhdm_base, _4K, false);
+        MapRange(targetPML4, GlobalPagingInfo.fbBase, GlobalPagingInfo.fbBase - GlobalPagingInfo.hhdm_base, GlobalPagingInfo.fbSize, MAP_WRITE | MAP_CACHE(CACHE_WC));
     }
 }
 
-struct PT* CreateProcessPML4(void* start, void* end, bool inKernelCode)
+/*
+    SUBROUTINE:
+
+    * CreateProcessPML4()
+    * Creates an address space that shares the kernel's tables: the upper half entries are copied, so
+    * they point at the same PDPTs as the kernel PML4, as are the lower half entries of the identity
+    * map the kernel's own pointers rely on. Task code is already reachable through the identity map
+    * or the kernel image and tasks run in ring 0, so nothing is mapped per process yet.
+    * Returns NULL if no frame is left for the PML4.
+*/
+struct PT* CreateProcessPML4(void*, void*, bool)
 {
-    struct PT* newpml = PageAlloc();
+    struct PT* newpml = PageAllocTry();
+    if (!newpml) return NULL; // Out of memory, the caller fails the process creation
 
-    uintptr_t offset = 0;
-    if (inKernelCode) offset = GlobalPagingInfo.kernelVirtBase;
+    AddrToPage(newpml)->flags |= PAGE_FLAG_PAGETABLE;
+    pageTablePages++;
 
-    for (uint64_t i = 0x200000; i < 0x40000000; i += 0x200000)
+    memcpy(&newpml->values[KERNEL_HALF_FIRST_ENTRY],
+           &pml4->values[KERNEL_HALF_FIRST_ENTRY],
+           (512 - KERNEL_HALF_FIRST_ENTRY) * sizeof(struct PTE));
+
+    for (size_t i = 0; i < KERNEL_HALF_FIRST_ENTRY; i++)
     {
-        MapMemory(newpml, i, i, _2M, false);
-        MapMemory(newpml, GlobalPagingInfo.hhdm_base + i, i, _2M, false);
+        if (pml4->values[i].Present) newpml->values[i] = pml4->values[i];
     }
 
-    for (uintptr_t i = 0; i < GlobalPagingInfo.kernelSize; i += 4096)
+    // TODO Load program at designated virtual addre
+    // Private lower half mappings must not go through the shared identity map PDPTs.
+
+    return newpml;
+}
+
+/*
+    SUBROUTINE:
+
+    * LoadAddressSpace()
+    * Switches to the given PML4. Does nothing if it is already loaded. With PCIDs the load keeps the
+    * TLB entries of the address space it switches to, unless its PCID is new.
+*/
+void LoadAddressSpace(struct PT* target)
+{
+    uint64_t cr3 = (uint64_t)target;
+
+    if (!pcids)
     {
-        MapMemory(
-            newpml,
-            GlobalPagingInfo.kernelVirtBase + i,
-            GlobalPagingInfo.kernelPhysBase + i,
-            _4K,
-            false
-        );
+        /*
+            EXTERNAL SUBROUTINE:
+
+            * cr3load()
+            * implemented in pageloading.asm
+            * loads a page map level 4 (PML4) into the appropriate register.
+        */
+        if ((read_cr3() & ~CR3_PCID_MASK) != cr3) cr3load(cr3);
+        return;
     }
 
-    if (!inKernelCode)
+    uint64_t flags = irq_save();
+
+    struct Page* page = AddrToPage(target);
+    uint64_t tag = page->owner;
+
+    if ((tag & CR3_PCID_MASK) && (tag >> 12) == pcidGeneration)
     {
-        for (void* addr = start; addr < end; addr += 4096)
+        cr3 |= tag & CR3_PCID_MASK;
+
+        if ((read_cr3() & ~CR3_NOFLUSH) != cr3) cr3load(cr3 | CR3_NOFLUSH);
+    }
+    else
+    {
+        if (nextPCID > PCID_MAX)
         {
-            MapMemory(newpml, (uintptr_t)addr + offset, (uintptr_t)addr, _4K, true);
+            FlushAllContexts();
+            pcidGeneration++;
+            nextPCID = 1;
         }
+
+        page->owner = (pcidGeneration << 12) | nextPCID++;
+        cr3 |= page->owner & CR3_PCID_MASK;
+
+        // A flushing load, so nothing cached under this number before the last wrap survives.
+        cr3load(cr3);
     }
 
-    // TODO Load program at designated virtual addre
+    irq_restore(flags);
+}
 
-    return newpml;
+/*
+    SUBROUTINE:
+
+    * IsPrivateRange()
+    * Whether [virt, virt + len) can hold mappings private to one address space: it is in the lower
+    * half and none of its PML4 entries is one CreateProcessPML4() shares with the kernel.
+*/
+bool IsPrivateRange(uint64_t virt, uint64_t len)
+{
+    if (!len || virt + len < virt || virt + len > ((uint64_t)KERNEL_HALF_FIRST_ENTRY << 39)) return false;
+
+    for (uint64_t i = virt >> 39; i <= (virt + len - 1) >> 39; i++)
+    {
+        if (pml4->values[i].Present) return false;
+    }
+
+    return true;
 }
 
 /* 
@@ -249,14 +826,18 @@ struct PT* CreateProcessPML4(void* start, void* end, bool inKernelCode)
 */
 void LoadKernelPML4()
 {
-    /*
-        EXTERNAL SUBROUTINE:
+    LoadAddressSpace(pml4);
+}
 
-        * cr3load()
-        * implemented in pageloading.asm
-        * loads a page map level 4 (PML4) into the appropriate register.
-    */
-    cr3load((uint64_t)pml4);
+/*
+    SUBROUTINE:
+
+    * GetKernelPML4()
+    * The global kernel PML4.
+*/
+struct PT* GetKernelPML4()
+{
+    return pml4;
 }
 
 /*
@@ -268,6 +849,8 @@ void LoadKernelPML4()
 void InitializePaging(struct limine_memmap_response mmap, uint64_t hhdm_base, uint64_t kernelSize, uint64_t kernelPhysBase, uint64_t kernelVirtBase, uintptr_t fbBase, uintptr_t fbSize)
 {
     pml4 = PageAlloc();
+    AddrToPage(pml4)->flags |= PAGE_FLAG_PAGETABLE;
+    pageTablePages++;
 
     GlobalPagingInfo.mmap = mmap;
     GlobalPagingInfo.hhdm_base = hhdm_base;
@@ -277,6 +860,47 @@ void InitializePaging(struct limine_memmap_response mmap, uint64_t hhdm_base, ui
     GlobalPagingInfo.fbBase = fbBase;
     GlobalPagingInfo.fbSize = fbSize;
 
+    gbPages = gbPagingSupported();
+
+    // Every upper half PDPT exists from the start, so kernel mappings made later (see KernelVmAlloc())
+    // show up in every address space through the PML4 entries copied by CreateProcessPML4().
+    for (size_t i = KERNEL_HALF_FIRST_ENTRY; i < 512; i++)
+    {
+        if (!GetEntryNextLevel(pml4, i)) panic("Out of memory for the kernel page tables!");
+    }
+
     CreateDefaultMappings(pml4);
+
+    // Our tables use PAT entry 1 for write-combining. The SDM sequence for a PAT change: write back
+    // the caches before the write, then flush caches and TLB again so nothing cached or translated
+    // under the old PAT survives into our tables and the write-combining framebuffer.
+    asm volatile ( "wbinvd" : : : "memory" );
+    wrmsr(MSR_PAT, PAT_VALUE);
+    asm volatile ( "wbinvd" : : : "memory" );
+    FlushAllContexts();
+
     LoadKernelPML4();
+
+    write_cr4(read_cr4() | CR4_PGE); // Global pages, every x86_64 CPU has them
+
+    // CR3 holds PCID 0 at this point, which PCIDE requires when it is set.
+    if (pcidSupported())
+    {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcids = true;
+    }
+
+    // Memory above 4GiB is only reachable through our own tables.
+    OnlineNormalZone();
+}
+
+/*
+    SUBROUTINE:
+
+    * GetPageTablePages()
+    * Number of frames allocated for paging structures, PML4s included. Tables are never freed yet.
+*/
+uint64_t GetPageTablePages()
+{
+    return pageTablePages;
 }
@@ -21,12 +21,13 @@ struct PTE
     uint64_t Present : 1; // Must be 1 to be allowed
     uint64_t RW : 1;
     uint64_t UserSupervisor : 1;
-    uint64_t PLWriteThrough : 1;
-    uint64_t PLCacheDisable : 1;
+    uint64_t PLWriteThrough : 1; // PAT index bit 0
+    uint64_t PLCacheDisable : 1; // PAT index bit 1
     uint64_t Accessed : 1;
     uint64_t Ignored : 1;
     uint64_t PageSize : 1; // We use 4KiB pages so this must be ignored.
-    uint64_t Ignored2 : 3;
+    uint64_t Global : 1; // Kept across CR3 loads, leaf entries only (needs CR4.PGE)
+    uint64_t Ignored2 : 2;
     uint64_t Ignored3 : 1;
     uint64_t PhysAddr : 40;
     uint64_t Reserved : 12;
@@ -36,8 +37,47 @@ typedef enum
 {
     _4K = 0,
     _2M = 1,
+    _1G = 2, // Only if the CPU supports it (CPUID 0x80000001 EDX bit 26)
 } PageSizes;
 
+/* Memory types, as PAT indices. See InitializePaging() for how the PAT is programmed. */
+typedef enum
+{
+    CACHE_WB = 0,       // Write-back, normal memory
+    CACHE_WC = 1,       // Write-combining, framebuffers and prefetchable BARs
+    CACHE_UC_MINUS = 2, // Uncached, unless the MTRRs say write-combining
+    CACHE_UC = 3,       // Uncached, device registers
+} CacheTypes;
+
+/* MapRange() flags */
+#define MAP_WRITE   (1 << 0)
+#define MAP_USER    (1 << 1)
+#define MAP_4K_ONLY (1 << 2) // Never use large pages, e.g. for ranges that will be split up later
+#define MAP_GLOBAL  (1 << 3) // Same in every address space, survives CR3 loads in the TLB
+#define MAP_CACHE(type)      ((uint32_t)(type) << 8) // Memory type, write-back if not given
+#define MAP_CACHE_TYPE(flags) ((CacheTypes)(((flags) >> 8) & 0x3))
+
+/*
+    * Page table changes gathered for one TLB flush. Up to TLB_FLUSH_THRESHOLD pages are flushed
+    * with invlpg each, more than that with a full flush.
+*/
+#define TLB_FLUSH_THRESHOLD 32
+
+struct TlbBatch
+{
+    uint64_t pages[TLB_FLUSH_THRESHOLD];
+    uint64_t count;  // Pages gathered, only the first TLB_FLUSH_THRESHOLD are recorded
+    bool global;     // A global entry was touched
+    bool local;      // A non-global entry was touched
+    void* frames;    // Freed after the flush, linked through their first word
+};
+
+/*
+    * Called by WalkRange() for each mapped piece of the range: bytes at virt map to phys through
+    * entry. Returning false stops the walk.
+*/
+typedef bool (*WalkCallback)(uint64_t virt, uint64_t phys, uint64_t bytes, struct PTE* entry, void* context);
+
 /* Page Table */
 struct PT
 {
@@ -46,6 +86,20 @@ struct PT
 
 void InitializePaging(struct limine_memmap_response mmap, uint64_t hhdm_base, uint64_t kernelSize, uint64_t kernelPhysBase, uint64_t kernelVirtBase, uintptr_t fbBase, uintptr_t fbSize);
 extern void cr3load(uint64_t cr3);
-KSTATUS MapMemory(struct PT* pml4, uint64_t virt, uint64_t phys, PageSizes size, bool user);
+KSTATUS MapMemory(struct PT* pml4, uint64_t virt, uint64_t phys, PageSizes size, bool user, CacheTypes cache);
+KSTATUS MapRange(struct PT* pml4, uint64_t virt, uint64_t phys, uint64_t len, uint32_t flags);
+KSTATUS UnmapMemory(struct PT* pml4, uint64_t virt, uint64_t* phys, struct TlbBatch* batch);
+KSTATUS UnmapRange(struct PT* pml4, uint64_t virt, uint64_t len, struct TlbBatch* batch);
+KSTATUS ProtectRange(struct PT* pml4, uint64_t virt, uint64_t len, uint32_t flags, struct TlbBatch* batch);
+KSTATUS VirtToPhys(struct PT* pml4, uint64_t virt, uint64_t* phys);
+KSTATUS WalkRange(struct PT* pml4, uint64_t virt, uint64_t len, WalkCallback callback, void* context);
+void TlbBatchInit(struct TlbBatch* batch);
+void TlbBatchFreeFrame(struct TlbBatch* batch, uint64_t phys);
+void TlbBatchFlush(struct TlbBatch* batch);
 struct PT* CreateProcessPML4(void* start, void* end, bool inKernelCode);
 void LoadKernelPML4();
+void LoadAddressSpace(struct PT* target);
+void RetireAddressSpaces();
+struct PT* GetKernelPML4();
+bool IsPrivateRange(uint64_t virt, uint64_t len);
+uint64_t GetPageTablePages();
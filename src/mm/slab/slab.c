@@ -0,0 +1,281 @@
+/*
+    * slab.c
+    *
+    * ABSTRACT:
+    *
+    *   -> Implements slab caches for fixed-size kernel objects. Allocation and free are O(1): take or
+    *   -> push the head of the slab's free list. The owning slab of an object is found through the
+    *   -> struct Page of its frame, so objects need no header.
+    *
+    * COPYRIGHT (C) 2023 DanielH
+    * This code along with the rest of this project is licensed under the MIT open-source license. A copy of the MIT license should be included in the source tree.
+    *
+*/
+
+#include "slab.h"
+#include <stdbool.h>
+#include "../allocator/allocator.h"
+#include "../../multitasking/spinlock.h"
+#include "../../system/error.h"
+#include "../../util/memutil.h"
+
+#define FRAME_SIZE 0x1000
+
+/* Caches are slab objects themselves, allocated from this one. */
+struct SlabCache cacheCache = {0};
+struct SlabCache* cacheList = NULL;
+INIT_SPINLOCK(cacheListLock);
+
+/*
+    SUBROUTINE:
+
+    * SetupCache()
+    * Picks the object and slab size. Returns false if an object does not fit in the largest slab.
+*/
+static bool SetupCache(struct SlabCache* cache, const char* name, uint64_t objectSize)
+{
+    if (objectSize < sizeof(void*)) objectSize = sizeof(void*); // Room for the free list link
+    objectSize = ALIGN_UP(objectSize, SLAB_ALIGN);
+
+    uint8_t order = 0;
+    uint64_t objects = 0;
+
+    for (; order <= SLAB_MAX_ORDER; order++)
+    {
+        objects = ((FRAME_SIZE << order) - sizeof(struct Slab)) / objectSize;
+        if (objects >= SLAB_MIN_OBJECTS) break;
+    }
+
+    if (order > SLAB_MAX_ORDER) order = SLAB_MAX_ORDER;
+    if (!objects) return false;
+
+    cache->name = name;
+    cache->objectSize = objectSize;
+    cache->objectsPerSlab = objects;
+    cache->order = order;
+    return true;
+}
+
+static void PushSlab(struct Slab** list, struct Slab* slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static void UnlinkSlab(struct Slab** list, struct Slab* slab)
+{
+    if (slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+/*
+    SUBROUTINE:
+
+    * NewSlab()
+    * Takes frames from the frame allocator and carves them into free objects.
+*/
+static struct Slab* NewSlab(struct SlabCache* cache)
+{
+    void* mem = cache->order ? PageAllocOrder(cache->order) : PageAllocNoZeroTry();
+    if (!mem) return NULL;
+
+    // Tag every frame, SlabFree() may be handed an object in any of them.
+    for (uint64_t i = 0; i < (1ULL << cache->order); i++)
+    {
+        struct Page* page = AddrToPage((uint8_t*)mem + i * FRAME_SIZE);
+
+        page->flags |= PAGE_FLAG_SLAB;
+        page->owner = (uint64_t)mem;
+    }
+
+    struct Slab* slab = mem;
+    slab->cache = cache;
+    slab->inUse = 0;
+    slab->freeList = NULL;
+
+    // Link the objects back to front so the free list hands them out in address order.
+    uint8_t* objects = (uint8_t*)mem + sizeof(struct Slab);
+    for (uint64_t i = cache->objectsPerSlab; i > 0; i--)
+    {
+        void** object = (void**)(objects + (i - 1) * cache->objectSize);
+
+        *object = slab->freeList;
+        slab->freeList = object;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+/* Untags the frames and returns them. The head frame's flags are reset by the frame allocator. */
+static void DestroySlab(struct SlabCache* cache, struct Slab* slab)
+{
+    for (uint64_t i = 1; i < (1ULL << cache->order); i++)
+    {
+        struct Page* page = AddrToPage((uint8_t*)slab + i * FRAME_SIZE);
+
+        page->flags &= ~PAGE_FLAG_SLAB;
+        page->owner = 0;
+    }
+
+    cache->slabs--;
+
+    if (cache->order) PageFreeOrder(slab, cache->order);
+    else PageFree(slab);
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * SlabCacheCreate()
+    * Creates a cache of objects of one size. Returns NULL if the size is too large for a slab.
+*/
+struct SlabCache* SlabCacheCreate(const char* name, uint64_t objectSize)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&cacheListLock);
+
+    if (!cacheCache.objectsPerSlab)
+    {
+        SetupCache(&cacheCache, "SlabCache", sizeof(struct SlabCache));
+        cacheCache.next = cacheList;
+        cacheList = &cacheCache;
+    }
+
+    spinlock_release_irqrestore(&cacheListLock, flags);
+
+    struct SlabCache* cache = SlabAlloc(&cacheCache);
+    if (!cache) return NULL;
+
+    memset(cache, 0, sizeof(struct SlabCache));
+
+    if (!SetupCache(cache, name, objectSize))
+    {
+        KernelSoftError("Slab cache object size too large");
+        SlabFree(cache);
+        return NULL;
+    }
+
+    flags = spinlock_acquire_irqsave(&cacheListLock);
+    cache->next = cacheList;
+    cacheList = cache;
+    spinlock_release_irqrestore(&cacheListLock, flags);
+
+    return cache;
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * SlabAlloc()
+    * Allocates one object. Contents are undefined.
+*/
+void* SlabAlloc(struct SlabCache* cache)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&cache->lock);
+
+    struct Slab* slab = cache->partial;
+
+    if (!slab)
+    {
+        slab = cache->empty;
+
+        if (slab) cache->empty = NULL;
+        else slab = NewSlab(cache);
+
+        if (!slab)
+        {
+            spinlock_release_irqrestore(&cache->lock, flags);
+            return NULL;
+        }
+
+        PushSlab(&cache->partial, slab);
+    }
+
+    void** object = slab->freeList;
+    slab->freeList = *object;
+    slab->inUse++;
+    cache->objectsInUse++;
+
+    if (slab->inUse == cache->objectsPerSlab)
+    {
+        UnlinkSlab(&cache->partial, slab);
+        PushSlab(&cache->full, slab);
+    }
+
+    spinlock_release_irqrestore(&cache->lock, flags);
+    return object;
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * SlabFree()
+    * Returns an object to the cache it came from.
+*/
+void SlabFree(void* object)
+{
+    if (!object) return;
+
+    struct Page* page = AddrToPage(object);
+
+    if (!page || !(page->flags & PAGE_FLAG_SLAB))
+    {
+        KernelSoftError("Freeing an object that is not from a slab cache");
+        return;
+    }
+
+    struct Slab* slab = (struct Slab*)page->owner;
+    struct SlabCache* cache = slab->cache;
+
+    uint64_t flags = spinlock_acquire_irqsave(&cache->lock);
+
+    if (slab->inUse == cache->objectsPerSlab)
+    {
+        UnlinkSlab(&cache->full, slab);
+        PushSlab(&cache->partial, slab);
+    }
+
+    *(void**)object = slab->freeList;
+    slab->freeList = object;
+    slab->inUse--;
+    cache->objectsInUse--;
+
+    if (!slab->inUse)
+    {
+        UnlinkSlab(&cache->partial, slab);
+
+        // Keep one empty slab so a cache bouncing around a slab boundary does not hit the frame allocator.
+        if (cache->empty) DestroySlab(cache, slab);
+        else cache->empty = slab;
+    }
+
+    spinlock_release_irqrestore(&cache->lock, flags);
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * GetSlabStats()
+    * Totals over every cache.
+*/
+void GetSlabStats(struct SlabStats* stats)
+{
+    stats->caches = 0;
+    stats->slabBytes = 0;
+    stats->objectBytes = 0;
+
+    uint64_t flags = spinlock_acquire_irqsave(&cacheListLock);
+
+    for (struct SlabCache* cache = cacheList; cache; cache = cache->next)
+    {
+        stats->caches++;
+        stats->slabBytes += cache->slabs * (FRAME_SIZE << cache->order);
+        stats->objectBytes += cache->objectsInUse * cache->objectSize;
+    }
+
+    spinlock_release_irqrestore(&cacheListLock, flags);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    * slab.h
+    * Object caches for fixed-size kernel structures. Each cache owns slabs: runs of frames holding a
+    * small header followed by tightly packed objects of a single size. Free objects are linked through
+    * their own first bytes, so objects carry no header of their own.
+*/
+
+#define SLAB_ALIGN 8        // Objects are rounded up to this size
+#define SLAB_MIN_OBJECTS 8  // A slab grows to SLAB_MAX_ORDER until this many objects fit
+#define SLAB_MAX_ORDER 3    // 32KiB
+
+struct Slab
+{
+    struct Slab* next;
+    struct Slab* prev;
+    struct SlabCache* cache;
+    void* freeList;
+    uint32_t inUse;
+    uint32_t unused;
+};
+
+struct SlabCache
+{
+    const char* name;
+    uint64_t objectSize;
+    uint32_t objectsPerSlab;
+    uint8_t order;          // Each slab is 2^order frames
+    _Atomic uint8_t lock;
+
+    /* A slab is on exactly one list, depending on how many of its objects are handed out. */
+    struct Slab* partial;
+    struct Slab* full;
+    struct Slab* empty;     // At most one is kept, further empty slabs go back to the frame allocator
+
+    uint64_t slabs;
+    uint64_t objectsInUse;
+
+    struct SlabCache* next; // All caches, for statistics
+};
+
+struct SlabStats
+{
+    uint64_t caches;
+    uint64_t slabBytes;   // Bytes taken from the frame allocator
+    uint64_t objectBytes; // Bytes handed out as objects
+};
+
+struct SlabCache* SlabCacheCreate(const char* name, uint64_t objectSize);
+void* SlabAlloc(struct SlabCache* cache);
+void SlabFree(void* object);
+void GetSlabStats(struct SlabStats* stats);
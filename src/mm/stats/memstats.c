@@ -0,0 +1,116 @@
+/*
+    * memstats.c
+    * 
+    * ABSTRACT:
+    * 
+    *   -> Collects the counters kept by the frame allocator, heap, slab, paging and demand paging code
+    *   -> into one snapshot, and dumps it to the serial port.
+    * 
+    * COPYRIGHT (C) 2023 DanielH
+    * This code along with the rest of this project is licensed under the MIT open-source license. A copy of the MIT license should be included in the source tree.
+    *
+*/
+
+#include "memstats.h"
+#include "../allocator/zeropool.h"
+#include "../paging/paging.h"
+#include "../vmm/vmm.h"
+#include "../../drivers/rtc/rtc.h"
+#include "../../util/print.h"
+#include "../../util/serial.h"
+
+uint64_t lastDumpTick = 0;
+
+/*
+    SUBROUTINE:
+
+    * GetMemoryStats()
+    * Fills in a snapshot of every memory counter.
+*/
+void GetMemoryStats(struct MemoryStats* stats)
+{
+    for (enum ZoneType zone = 0; zone < ZONE_COUNT; zone++) GetZoneStats(zone, &stats->zones[zone]);
+
+    stats->cachedFrames = GetCachedFrames();
+    stats->zeroedFrames = ZeroPoolSize();
+    GetHeapStats(&stats->heap);
+    GetSlabStats(&stats->slab);
+    stats->pageTablePages = GetPageTablePages();
+    stats->demandPages = GetDemandPages();
+}
+
+/*
+    SUBROUTINE:
+
+    * DumpMemoryStats()
+    * Prints a snapshot to the serial port. Sizes are in KiB.
+*/
+void DumpMemoryStats()
+{
+    struct MemoryStats stats;
+    GetMemoryStats(&stats);
+
+    serial_printf("[MEMSTATS] ----------------------------------------\n");
+
+    for (enum ZoneType zone = 0; zone < ZONE_COUNT; zone++)
+    {
+        struct ZoneStats* z = &stats.zones[zone];
+
+        serial_printf("[MEMSTATS] Zone %s: %d KiB total, %d KiB free, %d KiB used, largest free block %d KiB\n",
+                      z->name,
+                      (int)(z->totalFrames * 4),
+                      (int)(z->freeFrames * 4),
+                      (int)((z->totalFrames - z->freeFrames) * 4),
+                      (int)(z->largestFreeBlock * 4));
+    }
+
+    serial_printf("[MEMSTATS] Frame caches: %d KiB in magazines, %d KiB pre-zeroed\n",
+                  (int)(stats.cachedFrames * 4),
+                  (int)(stats.zeroedFrames * 4));
+    serial_printf("[MEMSTATS] Heap: %d KiB from frames, %d KiB in use, %d free list nodes, %d KiB in large allocations\n",
+                  (int)(stats.heap.heapBytes / 1024),
+                  (int)(stats.heap.bytesInUse / 1024),
+                  (int)stats.heap.freeNodes,
+                  (int)(stats.heap.largeBytes / 1024));
+    serial_printf("[MEMSTATS] Slab: %d caches, %d KiB in slabs, %d KiB in objects\n",
+                  (int)stats.slab.caches,
+                  (int)(stats.slab.slabBytes / 1024),
+                  (int)(stats.slab.objectBytes / 1024));
+    serial_printf("[MEMSTATS] Page tables: %d KiB, demand paged: %d KiB\n",
+                  (int)(stats.pageTablePages * 4),
+                  (int)(stats.demandPages * 4));
+}
+
+/*
+    SUBROUTINE:
+
+    * MemoryStatsPeriodicDump()
+    * Dumps the statistics every MEMSTATS_DUMP_SECONDS. Called from the idle loop.
+*/
+void MemoryStatsPeriodicDump()
+{
+    uint64_t now = RTC_GetTicks();
+
+    if (now - lastDumpTick < MEMSTATS_DUMP_SECONDS * RTC_TICKS_PER_SECOND) return;
+
+    lastDumpTick = now;
+    DumpMemoryStats();
+}
+
+/*
+    SUBROUTINE:
+
+    * MemoryStatsPollSerial()
+    * Serial console commands: 'm' dumps the memory statistics, 'h' dumps the heap profile.
+    * Called from the idle loop.
+*/
+void MemoryStatsPollSerial()
+{
+    while (serial_received())
+    {
+        char c = read_serial();
+
+        if (c == 'm') DumpMemoryStats();
+        else if (c == 'h') HeapProfileDump();
+    }
+}
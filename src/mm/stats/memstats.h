@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include "../allocator/allocator.h"
+#include "../heapalloc/heap.h"
+#include "../slab/slab.h"
+
+#define MEMSTATS_DUMP_SECONDS 30
+
+struct MemoryStats
+{
+    struct ZoneStats zones[ZONE_COUNT];
+    uint64_t cachedFrames;   // Free frames in per-CPU magazines
+    uint64_t zeroedFrames;   // Free frames in the zero pool
+    struct HeapStats heap;
+    struct SlabStats slab;
+    uint64_t pageTablePages;
+    uint64_t demandPages;    // Process pages faulted in and not yet released, task stacks included
+};
+
+void GetMemoryStats(struct MemoryStats* stats);
+void DumpMemoryStats();
+void MemoryStatsPeriodicDump();
+void MemoryStatsPollSerial();
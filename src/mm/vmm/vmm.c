@@ -1,17 +1,48 @@
+/*
+    * vmm.c
+    *
+    * ABSTRACT:
+    *
+    *   -> Process page allocation, and the kernel virtual memory area used for large allocations:
+    *   -> a range of address space is reserved, then every page is backed by its own frame.
+    *   -> Demand paging: process regions get a frame per page on the first fault in that page.
+    *
+    * COPYRIGHT (C) 2023 DanielH
+    * This code along with the rest of this project is licensed under the MIT open-source license. A copy of the MIT license should be included in the source tree.
+    *
+*/
+
 #include <stddef.h>
 #include "vmm.h"
 #include "../paging/paging.h"
 #include "../../multitasking/scheduler.h"
+#include "../../multitasking/spinlock.h"
 #include "../allocator/allocator.h"
 #include "../heapalloc/heap.h"
+#include "../slab/slab.h"
 #include "../../util/memutil.h"
+#include "../../system/error.h"
+
+#define VM_PAGE_SIZE 0x1000
+#define VM_GUARD_PAGES 1 // Left unmapped after each allocation so overruns fault
+
+/* Page fault error code bits, see Intel SDM Vol 3A 4.7 */
+#define PF_PRESENT (1 << 0) // The page was present, so this is a protection violation
+#define PF_WRITE   (1 << 1)
+
+struct SlabCache* vmRegionCache = NULL;
+struct VmRegion* vmFree = NULL; // Sorted by address, neighbours merged
+struct VmRegion* vmUsed = NULL;
+bool vmFreeReady = false;
+uint64_t demandPages = 0;
+INIT_SPINLOCK(vmLock);
 
 void* AllocatePage()
 {
     struct ProcessFrame process = GetCurrentProcess();
     uintptr_t page = (uintptr_t)PageAlloc();
 
-    MapMemory((void*)process.cr3, page, page, _4K, true);
+    MapMemory((void*)process.cr3, page, page, _4K, true, CACHE_WB);
     return (void*)page;
 }
 
@@ -23,3 +54,452 @@ void* AllocateBlock(size_t)
 
     return NULL;
 }
+
+/* Kernel and process region descriptors come from one cache. Called with vmLock held. */
+static struct VmRegion* NewRegion()
+{
+    if (!vmRegionCache) vmRegionCache = SlabCacheCreate("VmRegion", sizeof(struct VmRegion));
+    if (!vmRegionCache) return NULL;
+
+    struct VmRegion* region = SlabAlloc(vmRegionCache);
+    if (region) memset(region, 0, sizeof(struct VmRegion));
+
+    return region;
+}
+
+/*
+    SUBROUTINE:
+
+    * ReserveRange()
+    * First fit from the free ranges. Called with vmLock held.
+*/
+static uint64_t ReserveRange(uint64_t pages)
+{
+    if (!vmFreeReady)
+    {
+        vmFree = NewRegion();
+        if (!vmFree) return 0;
+
+        vmFree->base = KERNEL_VM_BASE;
+        vmFree->pages = KERNEL_VM_SIZE / VM_PAGE_SIZE;
+        vmFreeReady = true;
+    }
+
+    for (struct VmRegion** link = &vmFree; *link; link = &(*link)->next)
+    {
+        struct VmRegion* region = *link;
+
+        if (region->pages < pages) continue;
+
+        uint64_t base = region->base;
+        region->base += pages * VM_PAGE_SIZE;
+        region->pages -= pages;
+
+        if (!region->pages)
+        {
+            *link = region->next;
+            SlabFree(region);
+        }
+
+        return base;
+    }
+
+    return 0;
+}
+
+/*
+    SUBROUTINE:
+
+    * ReturnRange()
+    * Puts a range back on the free list, merging it with adjacent free ranges. Called with vmLock held.
+*/
+static void ReturnRange(uint64_t base, uint64_t pages)
+{
+    struct VmRegion* prev = NULL;
+    struct VmRegion* next = vmFree;
+
+    while (next && next->base < base)
+    {
+        prev = next;
+        next = next->next;
+    }
+
+    if (prev && prev->base + prev->pages * VM_PAGE_SIZE == base)
+    {
+        prev->pages += pages;
+
+        if (next && base + pages * VM_PAGE_SIZE == next->base)
+        {
+            prev->pages += next->pages;
+            prev->next = next->next;
+            SlabFree(next);
+        }
+
+        return;
+    }
+
+    if (next && base + pages * VM_PAGE_SIZE == next->base)
+    {
+        next->base = base;
+        next->pages += pages;
+        return;
+    }
+
+    struct VmRegion* region = NewRegion();
+    if (!region) return; // The range is lost, but stays unmapped
+
+    region->base = base;
+    region->pages = pages;
+    region->next = next;
+
+    if (prev) prev->next = region;
+    else vmFree = region;
+}
+
+/* Unmaps a range page by page and frees the frames behind it, with one TLB flush for the lot. */
+static void UnmapPages(uint64_t base, uint64_t pages)
+{
+    struct TlbBatch batch;
+    TlbBatchInit(&batch);
+
+    for (uint64_t i = 0; i < pages; i++)
+    {
+        uint64_t phys;
+
+        if (UnmapMemory(GetKernelPML4(), base + i * VM_PAGE_SIZE, &phys, &batch) == KSTATUS_SUCCESS) TlbBatchFreeFrame(&batch, phys);
+    }
+
+    TlbBatchFlush(&batch);
+}
+
+/*
+    SUBROUTINE:
+
+    * KernelVmAlloc()
+    * Reserves page aligned kernel address space for size bytes and backs it with frames.
+    * Memory is not cleared. Returns NULL if address space or frames run out.
+*/
+void* KernelVmAlloc(size_t size)
+{
+    uint64_t pages = ALIGN_UP(size, VM_PAGE_SIZE) / VM_PAGE_SIZE;
+    if (!pages || pages > KERNEL_VM_SIZE / VM_PAGE_SIZE) return NULL;
+
+    uint64_t flags = spinlock_acquire_irqsave(&vmLock);
+
+    uint64_t base = ReserveRange(pages + VM_GUARD_PAGES);
+    struct VmRegion* used = base ? NewRegion() : NULL;
+
+    if (!used)
+    {
+        if (base) ReturnRange(base, pages + VM_GUARD_PAGES);
+
+        spinlock_release_irqrestore(&vmLock, flags);
+        return NULL;
+    }
+
+    used->base = base;
+    used->pages = pages;
+    used->next = vmUsed;
+    vmUsed = used;
+
+    spinlock_release_irqrestore(&vmLock, flags);
+
+    for (uint64_t i = 0; i < pages; i++)
+    {
+        void* frame = PageAllocNoZeroTry();
+
+        if (!frame || MapMemory(GetKernelPML4(), base + i * VM_PAGE_SIZE, (uint64_t)frame, _4K, false, CACHE_WB) == KSTATUS_FAIL)
+        {
+            if (frame) PageFree(frame);
+
+            KernelVmFree((void*)base);
+            return NULL;
+        }
+    }
+
+    return (void*)base;
+}
+
+/*
+    SUBROUTINE:
+
+    * KernelVmFree()
+    * Unmaps an allocation made by KernelVmAlloc(), frees its frames and returns the address space.
+*/
+void KernelVmFree(void* addr)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&vmLock);
+
+    struct VmRegion** link = &vmUsed;
+    while (*link && (*link)->base != (uint64_t)addr) link = &(*link)->next;
+
+    struct VmRegion* region = *link;
+
+    if (!region)
+    {
+        spinlock_release_irqrestore(&vmLock, flags);
+        KernelSoftError("Freeing kernel address space that was not allocated");
+        return;
+    }
+
+    *link = region->next;
+    spinlock_release_irqrestore(&vmLock, flags);
+
+    // Pages that were never mapped (a failed KernelVmAlloc()) are skipped.
+    UnmapPages(region->base, region->pages);
+
+    flags = spinlock_acquire_irqsave(&vmLock);
+    ReturnRange(region->base, region->pages + VM_GUARD_PAGES);
+    SlabFree(region);
+    spinlock_release_irqrestore(&vmLock, flags);
+}
+
+/*
+    SUBROUTINE:
+
+    * KernelVmSize()
+    * Usable size of an allocation made by KernelVmAlloc(), or 0 if addr is not one.
+*/
+uint64_t KernelVmSize(void* addr)
+{
+    uint64_t size = 0;
+    uint64_t flags = spinlock_acquire_irqsave(&vmLock);
+
+    for (struct VmRegion* region = vmUsed; region; region = region->next)
+    {
+        if (region->base == (uint64_t)addr)
+        {
+            size = region->pages * VM_PAGE_SIZE;
+            break;
+        }
+    }
+
+    spinlock_release_irqrestore(&vmLock, flags);
+    return size;
+}
+
+/*
+    SUBROUTINE:
+
+    * AddProcessRegion()
+    * Records a demand paged range of a process. Nothing is mapped until it is touched.
+*/
+static KSTATUS AddProcessRegion(struct ProcessFrame* process, uint64_t base, uint64_t len, uint32_t flags, uint8_t* file, uint64_t fileSize)
+{
+    uint64_t pages = ALIGN_UP(len, VM_PAGE_SIZE) / VM_PAGE_SIZE;
+
+    if (!process || base % VM_PAGE_SIZE || !IsPrivateRange(base, pages * VM_PAGE_SIZE))
+    {
+        KernelSoftError("Process region outside the private part of the address space");
+        return KSTATUS_FAIL;
+    }
+
+    uint64_t lockFlags = spinlock_acquire_irqsave(&vmLock);
+    struct VmRegion* region = NewRegion();
+    spinlock_release_irqrestore(&vmLock, lockFlags);
+
+    if (!region) return KSTATUS_FAIL;
+
+    region->base = base;
+    region->pages = pages;
+    region->flags = flags & ~MAP_GLOBAL; // Private pages must not outlive a CR3 load in the TLB
+    region->file = file;
+    region->fileSize = file ? fileSize : 0;
+
+    lockFlags = spinlock_acquire_irqsave(&process->regionLock);
+
+    for (struct VmRegion* other = process->regions; other; other = other->next)
+    {
+        if (base < other->base + other->pages * VM_PAGE_SIZE && other->base < base + pages * VM_PAGE_SIZE)
+        {
+            spinlock_release_irqrestore(&process->regionLock, lockFlags);
+            SlabFree(region);
+
+            KernelSoftError("Process region overlaps another");
+            return KSTATUS_FAIL;
+        }
+    }
+
+    region->next = process->regions;
+    process->regions = region;
+
+    spinlock_release_irqrestore(&process->regionLock, lockFlags);
+    return KSTATUS_SUCCESS;
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * VmMapAnonymous()
+    * Gives a process len bytes of zero-filled memory at base (bss, heaps, task stacks). Pages get a
+    * frame on first touch. base must be page aligned and in a private part of the address space,
+    * see IsPrivateRange(). flags are MapRange() flags.
+*/
+KSTATUS VmMapAnonymous(struct ProcessFrame* process, uint64_t base, uint64_t len, uint32_t flags)
+{
+    return AddProcessRegion(process, base, len, flags, NULL, 0);
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * VmMapFile()
+    * Like VmMapAnonymous(), but the first fileSize bytes are copied from file as their pages are
+    * touched, e.g. an image in the ramdisk. file must stay in memory as long as the process does,
+    * and must not be demand paged itself: page faults share one stack, so FaultIn() must not fault.
+*/
+KSTATUS VmMapFile(struct ProcessFrame* process, uint64_t base, uint64_t len, void* file, uint64_t fileSize, uint32_t flags)
+{
+    if (fileSize > len) fileSize = len;
+
+    return AddProcessRegion(process, base, len, flags, file, fileSize);
+}
+
+/* The region of a process that holds page, or NULL. Called with the process's regionLock held. */
+static struct VmRegion* FindRegion(struct ProcessFrame* process, uint64_t page)
+{
+    for (struct VmRegion* region = process->regions; region; region = region->next)
+    {
+        if (page >= region->base && page - region->base < region->pages * VM_PAGE_SIZE) return region;
+    }
+
+    return NULL;
+}
+
+/*
+    SUBROUTINE:
+
+    * FaultIn()
+    * Gets the frame for one page of a region: a copy of the file where there is one, zeroes elsewhere.
+    * Takes a copy of the region, since it runs without the region lock: reading the file may fault
+    * again. Returns NULL when frames run out.
+*/
+static uint8_t* FaultIn(struct VmRegion* region, uint64_t page)
+{
+    uint64_t offset = page - region->base;
+    uint8_t* frame;
+
+    if (offset < region->fileSize)
+    {
+        uint64_t bytes = region->fileSize - offset;
+        if (bytes > VM_PAGE_SIZE) bytes = VM_PAGE_SIZE;
+
+        frame = PageAllocNoZeroTry();
+        if (!frame) return NULL;
+
+        memcpy(frame, region->file + offset, bytes);
+        memset(frame + bytes, 0, VM_PAGE_SIZE - bytes);
+    }
+    else
+    {
+        frame = PageAllocTry(); // Cleared, from the zero pool when it has frames
+    }
+
+    return frame;
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * HandlePageFault()
+    * Called by the page fault handler with CR2 and the error code. Maps the page if addr is in a
+    * region of the running process and the access is allowed. KSTATUS_FAIL means a real fault, or
+    * that no frame or page table was left for the page, both of which end the task.
+*/
+KSTATUS HandlePageFault(uint64_t addr, uint64_t error)
+{
+    struct ProcessFrame* process = GetCurrentProcessFrame();
+
+    // A fault on a present page is a protection violation, nothing here is copy-on-write.
+    if (!process || (error & PF_PRESENT)) return KSTATUS_FAIL;
+
+    uint64_t page = ALIGN_DOWN(addr, VM_PAGE_SIZE);
+
+    uint64_t flags = spinlock_acquire_irqsave(&process->regionLock);
+    struct VmRegion* region = FindRegion(process, page);
+
+    if (!region || ((error & PF_WRITE) && !(region->flags & MAP_WRITE)))
+    {
+        spinlock_release_irqrestore(&process->regionLock, flags);
+        return KSTATUS_FAIL;
+    }
+
+    struct VmRegion copy = *region;
+    spinlock_release_irqrestore(&process->regionLock, flags);
+
+    uint8_t* frame = FaultIn(&copy, page);
+    if (!frame) return KSTATUS_FAIL;
+
+    // The region may have been released while the frame was filled, or the page mapped by a fault
+    // on another CPU, in which case its mapping stands and the access is simply retried.
+    KSTATUS status = KSTATUS_SUCCESS;
+    bool mapped = false;
+    uint64_t phys;
+
+    flags = spinlock_acquire_irqsave(&process->regionLock);
+    region = FindRegion(process, page);
+
+    if (!region || region->base != copy.base || region->pages != copy.pages) status = KSTATUS_FAIL;
+    else if (VirtToPhys(process->cr3, page, &phys) == KSTATUS_FAIL)
+    {
+        status = MapRange(process->cr3, page, (uint64_t)frame, VM_PAGE_SIZE, region->flags | MAP_4K_ONLY);
+        mapped = (status == KSTATUS_SUCCESS);
+    }
+
+    if (mapped) demandPages++;
+    spinlock_release_irqrestore(&process->regionLock, flags);
+
+    if (!mapped) PageFree(frame);
+    return status;
+}
+
+static bool FreeRegionFrame(uint64_t, uint64_t phys, uint64_t, struct PTE*, void* batch)
+{
+    TlbBatchFreeFrame(batch, phys);
+    demandPages--;
+    return true;
+}
+
+/*
+    LIBRARY EXPORT:
+
+    * VmReleaseProcess()
+    * Unmaps every region of a process and frees the frames that were faulted in. Paging structures
+    * are kept, like everywhere else.
+*/
+void VmReleaseProcess(struct ProcessFrame* process)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&process->regionLock);
+
+    struct VmRegion* region = process->regions;
+    process->regions = NULL;
+
+    spinlock_release_irqrestore(&process->regionLock, flags);
+
+    struct TlbBatch batch;
+    TlbBatchInit(&batch);
+
+    while (region)
+    {
+        struct VmRegion* next = region->next;
+
+        // Only pages that were touched are mapped, so this visits nothing else. A process that
+        // never got its tables has nothing mapped at all.
+        if (process->cr3)
+        {
+            WalkRange(process->cr3, region->base, region->pages * VM_PAGE_SIZE, FreeRegionFrame, &batch);
+            UnmapRange(process->cr3, region->base, region->pages * VM_PAGE_SIZE, &batch);
+        }
+
+        SlabFree(region);
+        region = next;
+    }
+
+    TlbBatchFlush(&batch);
+}
+
+/* Process pages currently backed by a frame. */
+uint64_t GetDemandPages()
+{
+    return demandPages;
+}
@@ -1,4 +1,50 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../../system14.h"
+
+/*
+    * vmm.h
+    * Kernel virtual memory. Large allocations get a range of kernel address space backed by frames
+    * that need not be physically contiguous.
+*/
+
+#define KERNEL_VM_BASE 0xFFFFC00000000000 // Upper half, above the HHDM window
+#define KERNEL_VM_SIZE 0x1000000000       // 64GiB
+
+/*
+    * A range of kernel address space, in use or free, or a demand paged range of a process. Process
+    * regions are mapped a page at a time by HandlePageFault() on first touch.
+*/
+struct VmRegion
+{
+    uint64_t base;
+    uint64_t pages;
+    struct VmRegion* next;
+
+    /* Process regions only */
+    uint32_t flags;       // MapRange() flags for the pages faulted in
+    uint8_t* file;  // Backing bytes, NULL for zero-filled memory
+    uint64_t fileSize;    // Bytes of the region that come from file, the rest reads as zero
+};
+
+struct ProcessFrame;
 
 void* AllocatePage();
 void* AllocateBlock(size_t n);
+
+void* KernelVmAlloc(size_t size);
+void KernelVmFree(void* addr);
+uint64_t KernelVmSize(void* addr);
+
+KSTATUS VmMapAnonymous(struct ProcessFrame* process, uint64_t base, uint64_t len, uint32_t flags);
+KSTATUS VmMapFile(struct ProcessFrame* process, uint64_t base, uint64_t len, void* file, uint64_t fileSize, uint32_t flags);
+KSTATUS HandlePageFault(uint64_t addr, uint64_t error);
+void VmReleaseProcess(struct ProcessFrame* process);
+uint64_t GetDemandPages();
+
+static inline bool KernelVmContains(void* addr)
+{
+    return (uint64_t)addr >= KERNEL_VM_BASE && (uint64_t)addr - KERNEL_VM_BASE < KERNEL_VM_SIZE;
+}
@@ -17,8 +17,9 @@
 #include "scheduler.h"
 #include "../interrupts/idt.h"
 #include "../util/memutil.h"
-#include "../mm/heapalloc/heap.h"
+#include "../mm/slab/slab.h"
 #include "../mm/allocator/allocator.h"
+#include "../mm/vmm/vmm.h"
 #include "../util/print.h"
 #include "../util/string.h"
 #include "../system/panic.h"
@@ -33,6 +34,7 @@ struct ProcessFrame prochead =
 };
 
 struct ProcessFrame* current = {0};
+struct SlabCache* processFrameCache = NULL;
 
 /* 
     * SUBROUTINE TaskSwitch(struct Registers*)
@@ -88,7 +90,7 @@ void TaskSwitch(struct Registers* stack)
 
 void _TaskSwitch_Stage2()
 {
-    if (current && current != &prochead && current->cr3 && current->quanta) cr3load((uint64_t)current->cr3);
+    if (current && current != &prochead && current->cr3 && current->quanta) LoadAddressSpace(current->cr3);
 }
 
 /*
@@ -99,7 +101,29 @@ void IntAddTask(char* taskName, void* start, void* end, bool kernel)
 {
     asm ("cli");
 
-    struct ProcessFrame* frame = malloc(sizeof(struct ProcessFrame));
+    if (!processFrameCache) processFrameCache = SlabCacheCreate("ProcessFrame", sizeof(struct ProcessFrame));
+
+    struct ProcessFrame* frame = SlabAlloc(processFrameCache);
+    memset(frame, 0, sizeof(struct ProcessFrame));
+
+    // The stack only gets frames for the pages the task touches, the rest stays unmapped.
+    if (VmMapAnonymous(frame, TASK_STACK_TOP - TASK_STACK_SIZE, TASK_STACK_SIZE, MAP_WRITE) == KSTATUS_FAIL)
+    {
+        printf("(!) Could not reserve the stack of \"%s\", task not started.\n", taskName);
+        SlabFree(frame);
+        asm ("sti");
+        return;
+    }
+
+    frame->cr3 = CreateProcessPML4(start, end, kernel);
+    if (!frame->cr3)
+    {
+        printf("(!) Out of memory for the address space of \"%s\", task not started.\n", taskName);
+        VmReleaseProcess(frame);
+        SlabFree(frame);
+        asm ("sti");
+        return;
+    }
 
     frame->pid = highest_pid++;
 
@@ -111,9 +135,8 @@ void IntAddTask(char* taskName, void* start, void* end, bool kernel)
     frame->registers.cs = 0x08; // Kernel code segment
     frame->registers.rip = (uint64_t)start;
     frame->registers.ss = 0x10; // Kernel data segment
-    frame->cr3 = CreateProcessPML4(start, end, kernel);
 
-    frame->registers.rsp = (uint64_t)PageAlloc();
+    frame->registers.rsp = TASK_STACK_TOP - 8; // Aligned as if start had been called
     frame->registers.flags = 0x202;
 
     frame->next = prochead.next;
@@ -157,6 +180,7 @@ void TerminateTask(uint8_t pid)
             // Unlink the node
             // TODO Free the frame
             prev_frame->next = current_frame->next;
+            VmReleaseProcess(current_frame);
 
             return;
         }
@@ -216,4 +240,11 @@ void MarkSchedulingActive()
 struct ProcessFrame GetCurrentProcess()
 {
     return *current;
+}
+
+/* The running task, or NULL while no task is running. */
+struct ProcessFrame* GetCurrentProcessFrame()
+{
+    if (!current || current == &prochead) return NULL;
+    return current;
 }
\ No newline at end of file
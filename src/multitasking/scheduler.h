@@ -3,6 +3,12 @@
 #include "../mm/paging/paging.h"
 #include <stdbool.h>
 
+struct VmRegion;
+
+/* Each task's stack, demand paged in a PML4 slot private to its address space, see IsPrivateRange() */
+#define TASK_STACK_TOP  0x0000800000000000 // End of the lower half
+#define TASK_STACK_SIZE 0x10000
+
 struct ProcessFrame
 {
     uint8_t pid;
@@ -12,6 +18,9 @@ struct ProcessFrame
     struct PT* cr3;
     bool invalid;
 
+    struct VmRegion* regions; // Demand paged memory, see VmMapAnonymous()
+    _Atomic uint8_t regionLock;
+
     struct ProcessFrame* next;
 };
 
@@ -23,3 +32,4 @@ void ProcessExit();
 void CommonExceptionHandler(char* exceptionType);
 void MarkSchedulingActive();
 struct ProcessFrame GetCurrentProcess();
+struct ProcessFrame* GetCurrentProcessFrame();
@@ -14,3 +14,35 @@ void spinlock_release(_Atomic uint8_t* lock)
 {
     atomic_store(lock, 0);
 }
+
+/*
+    * spinlock_acquire_irqsoff()
+    * Takes the lock for a caller that already has interrupts disabled, leaving them that way.
+    * Spins with pause rather than hlt, as nothing would wake a halted CPU with interrupts off.
+*/
+void spinlock_acquire_irqsoff(_Atomic uint8_t* lock)
+{
+    while (atomic_exchange(lock, 1))
+    {
+        asm ("pause");
+    }
+}
+
+/*
+    * spinlock_acquire_irqsave()
+    * Takes the lock with interrupts disabled, so an interrupt on this CPU can never spin on it.
+*/
+uint64_t spinlock_acquire_irqsave(_Atomic uint8_t* lock)
+{
+    uint64_t flags = irq_save();
+
+    spinlock_acquire_irqsoff(lock);
+
+    return flags;
+}
+
+void spinlock_release_irqrestore(_Atomic uint8_t* lock, uint64_t flags)
+{
+    atomic_store(lock, 0);
+    irq_restore(flags);
+}
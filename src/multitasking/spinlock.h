@@ -5,3 +5,31 @@
 #define INIT_SPINLOCK(name) _Atomic uint8_t name = ATOMIC_VAR_INIT(0)
 void spinlock_acquire(_Atomic uint8_t* lock);
 void spinlock_release(_Atomic uint8_t* lock);
+void spinlock_acquire_irqsoff(_Atomic uint8_t* lock);
+uint64_t spinlock_acquire_irqsave(_Atomic uint8_t* lock);
+void spinlock_release_irqrestore(_Atomic uint8_t* lock, uint64_t flags);
+
+#ifndef SYSTEM14_HOSTED
+/* Disables interrupts and returns the previous RFLAGS for irq_restore(). */
+static inline uint64_t irq_save()
+{
+    uint64_t flags;
+    asm volatile ( "pushfq; popq %0; cli" : "=r"(flags) : : "memory" );
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags)
+{
+    if (flags & 0x200) asm volatile ( "sti" : : : "memory" );
+}
+#else
+/* Host builds (see bench/) run in user mode, where cli/sti would fault. */
+static inline uint64_t irq_save()
+{
+    return 0;
+}
+
+static inline void irq_restore(uint64_t)
+{
+}
+#endif
@@ -19,7 +19,7 @@
 #include <stdbool.h>
 #include "../util/print.h"
 #include "tar.h"
-#include "../mm/heapalloc/heap.h"
+#include "../mm/slab/slab.h"
 #include "../util/memutil.h"
 #include "../util/string.h"
 
@@ -30,10 +30,14 @@ struct FileNode filehead =
     0
 };
 
+struct SlabCache* fileNodeCache = NULL;
+
 void InsertEntry(char FilePath[100], uint32_t FileSize, char* FileBegin)
 {
     // Insert the entry
-    struct FileNode* node = malloc(sizeof(struct FileNode));
+    if (!fileNodeCache) fileNodeCache = SlabCacheCreate("FileNode", sizeof(struct FileNode));
+
+    struct FileNode* node = SlabAlloc(fileNodeCache);
 
     node->next = filehead.next;
     strcpy(node->FilePath, FilePath);
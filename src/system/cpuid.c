@@ -20,6 +20,7 @@
 #include "../util/print.h"
 
 #define HUGE_PAGES_1G (1 << 26)
+#define PCID (1 << 17)
 
 struct CPUIDRegisters
 {
@@ -45,4 +46,30 @@ struct CPUIDRegisters getCpuidData()
 
     return ret;
 
-}
\ No newline at end of file
+}
+
+/*
+    SUBROUTINE:
+
+    * gbPagingSupported()
+    * Whether the CPU can map 1GiB pages from the PDPT.
+*/
+bool gbPagingSupported()
+{
+    return (getCpuidData().edx & HUGE_PAGES_1G) != 0;
+}
+
+/*
+    SUBROUTINE:
+
+    * pcidSupported()
+    * Whether CR4.PCIDE can be set (leaf 1 ECX bit 17).
+*/
+bool pcidSupported()
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    __cpuid(1, eax, ebx, ecx, edx);
+
+    return (ecx & PCID) != 0;
+}
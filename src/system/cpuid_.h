@@ -2,3 +2,4 @@
 #include <stdbool.h>
 
 bool gbPagingSupported();
+bool pcidSupported();
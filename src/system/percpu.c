@@ -0,0 +1,32 @@
+/*
+    * percpu.c
+    * 
+    * ABSTRACT:
+    * 
+    *   -> Sets up the per-CPU data block and points GS at it, so a CPU can find its own data
+    *   -> without touching shared memory or the local APIC.
+    * 
+    * COPYRIGHT (C) 2023 DanielH
+    * This code along with the rest of this project is licensed under the MIT open-source license. A copy of the MIT license should be included in the source tree.
+    * 
+*/
+
+#include "percpu.h"
+#include "../util/msr.h"
+#include "panic.h"
+
+struct PerCPU CPUs[MAX_CPUS] = {0};
+
+/*
+    * SUBROUTINE InitializePerCPU(uint32_t)
+    * Must run on the CPU it describes, after the GDT is loaded (loading GS clears its base).
+*/
+void InitializePerCPU(uint32_t id)
+{
+    if (id >= MAX_CPUS) panic("CPU index out of range!");
+
+    CPUs[id].self = &CPUs[id];
+    CPUs[id].id = id;
+
+    wrmsr(MSR_GS_BASE, (uint64_t)&CPUs[id]);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_CPUS 64
+
+/* Per-CPU data block, GS points at the running CPU's block. */
+struct PerCPU
+{
+    struct PerCPU* self;
+    uint32_t id;
+};
+
+void InitializePerCPU(uint32_t id);
+
+/*
+    * GetCPUId()
+    * Index of the running CPU. Only valid after InitializePerCPU() ran on that CPU.
+*/
+static inline uint32_t GetCPUId()
+{
+    uint32_t id;
+    asm volatile ( "movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(struct PerCPU, id)) );
+    return id;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+
+/* Control registers, see Intel SDM Vol 3A 2.5 */
+#define CR4_PGE   (1ULL << 7)  // Global pages
+#define CR4_PCIDE (1ULL << 17) // Process-context identifiers
+
+#define CR3_PCID_MASK 0xFFFULL
+#define CR3_NOFLUSH   (1ULL << 63) // With CR4.PCIDE, keep the new PCID's TLB entries on load
+
+static inline uint64_t read_cr2()
+{
+    uint64_t value;
+    asm volatile ( "mov %%cr2, %0" : "=r"(value) );
+    return value;
+}
+
+static inline uint64_t read_cr3()
+{
+    uint64_t value;
+    asm volatile ( "mov %%cr3, %0" : "=r"(value) );
+    return value;
+}
+
+static inline uint64_t read_cr4()
+{
+    uint64_t value;
+    asm volatile ( "mov %%cr4, %0" : "=r"(value) );
+    return value;
+}
+
+static inline void write_cr4(uint64_t value)
+{
+    asm volatile ( "mov %0, %%cr4" : : "r"(value) : "memory" );
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+
+/* Model specific registers, see Intel SDM Vol 4 */
+#define MSR_PAT     0x277
+#define MSR_GS_BASE 0xC0000101
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t low, high;
+    asm volatile ( "rdmsr"
+                   : "=a"(low), "=d"(high)
+                   : "c"(msr) );
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile ( "wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) );
+}
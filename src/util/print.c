@@ -68,15 +68,11 @@ void lprint(const char* str, int n)
 }
 
 /*
-    * SUBROUTINE printf(char*, ...)
-    * Standard printf() function with limited formatting options
-    * For use in kernel mode debugging
+    * SUBROUTINE vformat(void (*)(char), char*, va_list)
+    * Formatting core shared by printf() and serial_printf(), every character goes to out.
 */
-void printf(const char* format, ...)
+static void vformat(void (*out)(char), const char* format, va_list args)
 {
-    va_list args;
-    va_start(args, format);
-
     while (*format != '\0')
     {
         if (*format == '%') // Special formatting character
@@ -86,25 +82,25 @@ void printf(const char* format, ...)
             {
                 int v = va_arg(args, int);
 
-                print(itoa(v));
+                for (const char* str = itoa(v); *str; str++) out(*str);
             }
             else if (*format == 's')
             {
                 char* v = va_arg(args, char*);
 
-                print((const char*)v);
+                for (const char* str = v; *str; str++) out(*str);
             }
             else if (*format == 'x')
             {
                 uintptr_t v = va_arg(args, uintptr_t);
 
-                print((const char*)hexToString(v));
+                for (const char* str = hexToString(v); *str; str++) out(*str);
             }
             else if (*format == 'c')
             {
                 int v = va_arg(args, int);
 
-                putchar((char)v);
+                out((char)v);
             }
 
             format++;
@@ -113,10 +109,44 @@ void printf(const char* format, ...)
         }
         else
         {
-            printf("%c", *format);
+            out(*format);
             format++;
         }
     }
+}
+
+/*
+    * SUBROUTINE printf(char*, ...)
+    * Standard printf() function with limited formatting options
+    * For use in kernel mode debugging
+*/
+void printf(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    vformat(putchar, fmt, args);
+
+    va_end(args);
+}
+
+static void serial_putchar(char c)
+{
+    if (c == '\n')
+        write_serial('\r');
+    write_serial(c);
+}
+
+/*
+    * SUBROUTINE serial_printf(char*, ...)
+    * printf() to the serial port only, for diagnostics that should not clutter the screen.
+*/
+void serial_printf(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    vformat(serial_putchar, fmt, args);
 
     va_end(args);
 }
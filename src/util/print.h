@@ -17,6 +17,7 @@
 #include <stdint.h>
 
 void printf(const char* format, ...);
+void serial_printf(const char* format, ...);
 void lprint(const char* str, int n);
 
 /*
@@ -29,3 +29,15 @@ void write_serial(char c)
 
     outb(COM1, c);
 }
+
+int serial_received()
+{
+    return inb(COM1 + 5) & 1;
+}
+
+char read_serial()
+{
+    while (serial_received() == 0); // wait for a byte
+
+    return inb(COM1);
+}
@@ -1,3 +1,5 @@
 #pragma once
 
 void write_serial(char c);
+int serial_received();
+char read_serial();